@@ -0,0 +1,27 @@
+#!/bin/sh
+# Job table stress: starts many short background jobs at once and checks that
+# the shell reaps every one of them. A lost exit notification leaves a job in
+# the table forever, so the run would hit the timeout instead of exiting.
+#
+# Usage: jobs_stress.sh [shell] [jobs] [timeout seconds]
+
+SHELL_BIN=${1:-./proj02}
+JOBS=${2:-1000}
+TIMEOUT=${3:-120}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+echo "mode parallel $JOBS" > "$SCRIPT" # all of them at once, not one per cpu
+i=0
+while [ $i -lt $JOBS ]; do
+    echo "sleep 0.0$((i % 10))" >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+start=$(date +%s%N)
+if ! timeout "$TIMEOUT" "$SHELL_BIN" "$SCRIPT" < /dev/null > /dev/null; then
+    echo "FAILED: $JOBS jobs were not all reaped within $TIMEOUT seconds"
+    exit 1
+fi
+end=$(date +%s%N)
+echo "$JOBS concurrent jobs started and reaped in $(( (end - start) / 1000000 )) ms"
@@ -0,0 +1,92 @@
+/******************************************************************************\
+ * Parse benchmark                                                            *
+ *                                                                            *
+ * Purpose: measures how many lines per second the shell can split into       *
+ *          commands and words, with the old strtok tokenizer and with the   *
+ *          single pass parser                                                *
+ *                                                                            *
+ * Usage: parse_bench [lines]                                                 *
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* from main.c (built with NO_SHELL_MAIN) */
+typedef struct _arena arena;
+typedef struct _parsed_line parsed_line;
+char** tokenify(char* buffer, char* split);
+void free_tokens(char** tokens);
+parsed_line* parse_line(arena* a, char* line, bool expand);
+void arena_reset(arena* a);
+arena* arena_create();
+void arena_destroy(arena* a);
+
+static char* lines [] = {
+    "ls -l /tmp",
+    "echo one; echo two; echo three",
+    "grep -v foo /etc/passwd | sort | uniq -c | sort -rn | head -5",
+    "make CC=gcc CFLAGS=-O2 -j8 all install; echo done",
+    "cat a b c d e f g h i j k l m n o p q r s t u v w x y z",
+};
+static const int NUM_LINES = sizeof(lines) / sizeof(lines[0]);
+
+double elapsed_since(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// what run_line used to do: a strdup and two strtok passes per split
+double run_tokenify(int count) {
+    char whitespace [] = "\n\t\r ";
+    struct timespec start;
+    int i, j, k;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        char buffer [1024];
+        strcpy(buffer, lines[i % NUM_LINES]);
+        char** commands = tokenify(buffer, ";");
+        for (j = 0; commands[j] != NULL; j++) {
+            char** stages = tokenify(commands[j], "|");
+            for (k = 0; stages[k] != NULL; k++) {
+                free_tokens(tokenify(stages[k], whitespace));
+            }
+            free_tokens(stages);
+        }
+        free_tokens(commands);
+    }
+    return count / elapsed_since(&start);
+}
+
+double run_parse_line(int count) {
+    arena* a = arena_create();
+    struct timespec start;
+    int i;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (parse_line(a, lines[i % NUM_LINES], true) == NULL) {
+            fprintf(stderr, "Could not parse %s.\n", lines[i % NUM_LINES]);
+            exit(1);
+        }
+        arena_reset(a);
+    }
+    double rate = count / elapsed_since(&start);
+    arena_destroy(a);
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    
+    printf("%d lines, %d distinct\n", count, NUM_LINES);
+    double old_rate = run_tokenify(count);
+    double new_rate = run_parse_line(count);
+    printf("tokenify:   %12.0f lines/sec\n", old_rate);
+    printf("parse_line: %12.0f lines/sec (%.2fx)\n", new_rate, new_rate / old_rate);
+    return 0;
+}
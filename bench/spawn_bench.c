@@ -0,0 +1,67 @@
+/******************************************************************************\
+ * Spawn benchmark                                                            *
+ *                                                                            *
+ * Purpose: measures how many short processes per second the shell's launch  *
+ *          backends can start and collect                                    *
+ *                                                                            *
+ * Usage: spawn_bench [count] [parent heap in MB] [program]                   *
+ *        A bigger parent heap shows how fork slows down as the shell grows   *
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* from main.c (built with NO_SHELL_MAIN) */
+struct _job_limits;
+pid_t launch_process(char** params, int* fds, struct _job_limits* limits, int* exec_errno);
+bool set_spawn_backend(char* name);
+
+double run_backend(char* backend, int count, char* program) {
+    char* params [] = {program, NULL};
+    struct timespec start, end;
+    int i;
+    
+    set_spawn_backend(backend);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        int exec_errno;
+        pid_t pid = launch_process(params, NULL, NULL, &exec_errno);
+        if (pid < 0) {
+            fprintf(stderr, "%s: could not launch %s.\n", backend, program);
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return count / elapsed;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 5000;
+    int heap_mb = argc > 2 ? atoi(argv[2]) : 0;
+    char* program = argc > 3 ? argv[3] : "/bin/true";
+    
+    // touch the heap so the pages are really mapped in the parent
+    char* heap = NULL;
+    if (heap_mb > 0) {
+        heap = malloc((size_t) heap_mb << 20);
+        if (heap != NULL) memset(heap, 1, (size_t) heap_mb << 20);
+    }
+    
+    printf("%d launches of %s, %d MB parent heap\n", count, program, heap_mb);
+    double fork_rate = run_backend("fork", count, program);
+    double spawn_rate = run_backend("spawn", count, program);
+    printf("fork:  %10.0f launches/sec\n", fork_rate);
+    printf("spawn: %10.0f launches/sec (%.2fx)\n", spawn_rate, spawn_rate / fork_rate);
+    
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Startup benchmark: starts the shell repeatedly with a trivial command and
+# reports the average time per start.
+#
+# Usage: startup.sh [shell] [runs]
+
+SHELL_BIN=${1:-./proj02}
+RUNS=${2:-1000}
+
+start=$(date +%s%N)
+i=0
+while [ $i -lt $RUNS ]; do
+    "$SHELL_BIN" -c exit < /dev/null > /dev/null
+    i=$((i + 1))
+done
+end=$(date +%s%N)
+
+elapsed_us=$(( (end - start) / 1000 ))
+echo "$RUNS starts of $SHELL_BIN in $((elapsed_us / 1000)) ms, $((elapsed_us / RUNS)) us per start"
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Benchmark suite: runs synthetic command streams through the shell's batch
+# mode, sequentially and in parallel, and reports throughput, the shell's own
+# per-command overhead (from its -S stats) and its peak memory. Run it before
+# and after a change to catch regressions.
+#
+# Usage: suite.sh [shell] [scale]
+#        scale multiplies the size of every workload, 1 takes a few seconds
+
+SHELL_BIN=${1:-./proj02}
+SCALE=${2:-1}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# repeat count line: prints the line count times
+repeat() {
+    i=0
+    while [ $i -lt "$1" ]; do
+        echo "$2"
+        i=$((i + 1))
+    done
+}
+
+# a number from the stats json: field phase key
+field() {
+    grep -o "\"$1\": {[^}]*}" "$DIR/stats.json" | grep -o "\"$2\": [0-9]*" | grep -o '[0-9]*$'
+}
+
+repeat $((2000 * SCALE)) "/bin/true" > "$DIR/tiny"
+
+chain=$(repeat 50 "/bin/true;" | tr -d '\n')
+repeat $((40 * SCALE)) "$chain" > "$DIR/chain"
+
+repeat $((500 * SCALE)) "echo builtin; pwd; type ls; hash ls; mode" > "$DIR/builtins"
+
+repeat $((64 * SCALE)) "sleep 0.01" > "$DIR/fanout"
+
+args=$(repeat 2000 "argument" | tr '\n' ' ')
+repeat $((200 * SCALE)) "/bin/echo $args" > "$DIR/longargs"
+
+printf "%-10s %-10s %9s %10s %9s %9s %8s\n" workload mode commands cmds/sec "p50 us" "p99 us" "rss KB"
+for workload in tiny chain builtins fanout longargs; do
+    for mode in sequential parallel; do
+        flags=""
+        [ $mode = parallel ] && flags="-p -j 64"
+        if ! "$SHELL_BIN" $flags -S "$DIR/stats.json" -f "$DIR/$workload" < /dev/null > /dev/null 2> "$DIR/summary"; then
+            echo "FAILED: $workload in $mode mode"
+            cat "$DIR/summary"
+            exit 1
+        fi
+        commands=$(head -n 1 "$DIR/summary" | cut -d ' ' -f 1)
+        rate=$(head -n 1 "$DIR/summary" | sed 's/.*s, \([0-9.]*\) commands\/sec.*/\1/')
+        p50=$(field overhead p50_ns)
+        p99=$(field overhead p99_ns)
+        rss=$(grep -o '"maxrss_kb": [0-9]*' "$DIR/stats.json" | grep -o '[0-9]*$')
+        printf "%-10s %-10s %9s %10s %9s %9s %8s\n" $workload $mode "$commands" "$rate" \
+               $((p50 / 1000)) $((p99 / 1000)) "$rss"
+    done
+done
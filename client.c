@@ -0,0 +1,158 @@
+/******************************************************************************\
+ * Shell client                                                               *
+ *                                                                            *
+ * Purpose: sends commands to a shell started in server mode (proj02 -L) and  *
+ *          prints each command's exit status and run time to stderr. The    *
+ *          commands read and write this program's own stdin, stdout and     *
+ *          stderr, which are handed to the server with the connection       *
+ *                                                                            *
+ * Usage: shelby-client socket [command ...]                                  *
+ *        Each command is one line; without any, lines are read from stdin   *
+\******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int connect_to(char* socket_path);
+bool send_stdio(int conn, int* fds);
+bool write_some(int fd, char** data, size_t* len);
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s socket [command ...]\n", argv[0]);
+        return 1;
+    }
+    int conn = connect_to(argv[1]);
+    if (conn < 0) return 1;
+
+    // commands from stdin leave nothing for them to read, they get /dev/null
+    bool from_stdin = argc == 2;
+    int fds[3] = {from_stdin ? open("/dev/null", O_RDONLY) : STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (fds[0] < 0 || !send_stdio(conn, fds)) {
+        fprintf(stderr, "Failed to pass stdin, stdout and stderr: %s.\n", strerror(errno));
+        return 1;
+    }
+    if (from_stdin) close(fds[0]);
+
+    // the command arguments as one block of lines
+    size_t size = 1, i;
+    for (i = 2; i < (size_t) argc; i++) size += strlen(argv[i]) + 1;
+    char* lines = calloc(size, 1);
+    for (i = 2; i < (size_t) argc; i++) {
+        strcat(lines, argv[i]);
+        strcat(lines, "\n");
+    }
+    char* pending = lines;
+    size_t pending_len = size - 1;
+
+    /* replies are read while commands are still being sent, or a long batch
+     * would fill the socket both ways and neither side could go on */
+    char input [65536], reply [256];
+    size_t reply_len = 0;
+    int status = 1; // nothing ran
+    bool sending = true;
+    fcntl(conn, F_SETFL, O_NONBLOCK);
+    while (true) {
+        if (sending && pending_len == 0 && from_stdin) {
+            ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+            if (n < 0 && errno == EINTR) continue;
+            pending = input;
+            pending_len = n > 0 ? n : 0;
+            if (n <= 0) from_stdin = false;
+        }
+        if (sending && pending_len == 0 && !from_stdin) {
+            shutdown(conn, SHUT_WR); // tells the server there is nothing more
+            sending = false;
+        }
+
+        struct pollfd pfd = {conn, POLLIN | (sending ? POLLOUT : 0), 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if ((pfd.revents & POLLOUT) && !write_some(conn, &pending, &pending_len)) {
+            fprintf(stderr, "Lost the connection to the shell: %s.\n", strerror(errno));
+            break;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        ssize_t n = read(conn, reply + reply_len, sizeof(reply) - reply_len - 1);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) break; // the server closes once the last job is done
+        reply_len += n;
+        reply[reply_len] = '\0';
+        char* line = reply;
+        char* newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            fprintf(stderr, "%s\n", line);
+            status = atoi(line);
+            line = newline + 1;
+        }
+        reply_len = strlen(line);
+        memmove(reply, line, reply_len + 1);
+    }
+    free(lines);
+    close(conn);
+    return status;
+}
+
+int connect_to(char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0 || connect(conn, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        fprintf(stderr, "Failed to connect to %s: %s.\n", socket_path, strerror(errno));
+        if (conn >= 0) close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+// one byte with the three descriptors attached, as the server expects first
+bool send_stdio(int conn, int* fds) {
+    char byte = 0;
+    struct iovec data = {&byte, 1};
+    union {
+        char buffer [CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, 3 * sizeof(int));
+    return sendmsg(conn, &message, MSG_NOSIGNAL) == 1;
+}
+
+// writes what the socket will take now and moves past it
+bool write_some(int fd, char** data, size_t* len) {
+    ssize_t n = send(fd, *data, *len, MSG_NOSIGNAL);
+    if (n < 0) return errno == EAGAIN || errno == EINTR;
+    *data += n;
+    *len -= n;
+    return true;
+}
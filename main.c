@@ -8,6 +8,7 @@
  * Usage: Runs a REPL that calls commands Unix shell                          *
 \******************************************************************************/
 
+#define _GNU_SOURCE
 #include <stropts.h>
 #include <stdio_ext.h>
 #include <poll.h>
@@ -23,6 +24,25 @@
 #include <errno.h>
 #include <dirent.h>
 #include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include <termios.h>
+#include <sys/ioctl.h>
 
 /* known issues
  * prompt prints twice over in parallel mode sometimes *** it was for some built in commands because they returned. *** fixed
@@ -35,7 +55,6 @@
  */
  
  /* still to-do
-  * access command history through bangs
   * free memory on ctrl +c?
   * reduce memory consumption
   */
@@ -45,216 +64,1861 @@
 static const int SEQUENTIAL = 0;
 static const int PARALLEL   = 1;
 
+/* process launch backends. posix_spawn uses vfork semantics in glibc so it
+ * does not copy the shell's page tables for every command */
+static const int SPAWN_FORK  = 0;
+static const int SPAWN_POSIX = 1;
+
+/* how a pipeline depends on the one before it: ;, && or || */
+static const int CONNECT_ALWAYS = 0;
+static const int CONNECT_AND    = 1;
+static const int CONNECT_OR     = 2;
+
+/* where the output of parallel jobs goes. Direct leaves the terminal to the
+ * jobs; line and group read it through pipes and write whole lines, or all
+ * of a job's output at once when it is done, like GNU parallel */
+static const int OUTPUT_DIRECT = 0;
+static const int OUTPUT_LINE   = 1;
+static const int OUTPUT_GROUP  = 2;
+
+/* resource limits and priorities for the commands the shell starts. They are
+ * applied in the child between fork and exec, so posix_spawn can't be used
+ * for a limited command */
+typedef struct _job_limits {
+    rlim_t cpu; // seconds, RLIM_INFINITY when not limited
+    rlim_t address; // bytes of address space
+    rlim_t files; // open descriptors
+    int nice; // added to the shell's niceness
+    int io_class; // IOPRIO_CLASS_*, 0 leaves the io priority alone
+    int io_level;
+} job_limits;
+
 /* shell state (there was too much state specific information to pass around) */
 typedef struct _prog_state {
     bool do_exit;
     bool in_parallel;
     int mode;
+    int last_status; // exit status of the last foreground command, returned when the shell exits
+    int max_jobs; // parallel jobs allowed to run at once, the rest wait in the job queue
+    bool pin_cpus; // give each parallel job its own cpu, round robin
+    int* cpus; // cpus the shell may run on
+    int num_cpus;
+    int next_cpu;
+    job_limits limits; // applied to every command, the limit prefix adds to them
 } program_state;
 
-// plan to implement bangs
+/* command history. Lines are appended to a memory mapped file, so a new
+ * shell only has to look at the tail of the file that it keeps instead of
+ * reading all of it. In memory the history is a ring of offsets into the
+ * mapping, bounded both by a number of entries and by the bytes they cover */
+#define HISTORY_SIZE 100000 // entries kept in the ring
+#define HISTORY_BYTES (16 << 20) // text the ring may refer to
+#define HISTORY_FILE_MAX (64 << 20) // past this the file is cut back to what the ring keeps
+#define HISTORY_GROW (1 << 20) // the file and mapping grow in steps of this
+#define HISTORY_FILE ".shelby_history"
+#define HISTORY_MAGIC "SHELBYH1"
+#define HISTORY_LITERAL " \t\r\n=;|&()'\"" // a ! followed by one of these, or by nothing, is kept as it is
+
+typedef struct _history_header {
+    char magic [8];
+    uint64_t count; // lines ever written, which is the number of the newest one
+    uint64_t used; // bytes of lines after the header, each ending in \n
+} history_header;
+
+typedef struct _history_entry {
+    size_t offset; // from the end of the header
+    size_t len;
+} history_entry;
+
 typedef struct _history {
-    struct _history *previous;
-    char command [1024];
-    struct _history *next;
+    char* map; // header followed by the lines
+    size_t map_size;
+    int fd; // -1 when the history only lives in memory
+    history_entry* ring;
+    long first; // ring slot of the oldest entry
+    long count; // entries in the ring
+    size_t bytes; // text the ring refers to, newlines included
 } history;
 
 /* linked list for storing shell environmenr directory */
 typedef struct _path {
     char path_var [1024];
+    struct timespec mtime; // modification time at the last check, used to invalidate the command cache
     struct _path *next;
 } path;
 
+/* hashed command lookup (works like bash's hash). The path directories are
+ * stat'ed once per line, on its first lookup, and the whole cache is thrown
+ * out when any of them was modified */
+#define CMD_CACHE_SIZE 256
+
+typedef struct _cmd_cache_entry {
+    char name [128];
+    char full_path [1024];
+    int hits;
+    struct _cmd_cache_entry *next;
+} cmd_cache_entry;
+
+typedef struct _cmd_cache {
+    cmd_cache_entry* buckets [CMD_CACHE_SIZE];
+    long hits;
+    long misses;
+    bool checked; // the directories were stat'ed for the line being run
+} cmd_cache;
+
+
+/* per-line bump allocator. Everything the parser produces for a line lives in
+ * an arena and is thrown away in one go once the line has run */
+typedef struct _arena_block {
+    struct _arena_block *next;
+    size_t size;
+    size_t used;
+    char data [];
+} arena_block;
+
+typedef struct _arena {
+    arena_block* blocks; // newest first
+    size_t total; // bytes handed out since the last reset
+} arena;
+
+#define ARENA_BLOCK_SIZE 4096
+
+/* a parsed line is a list of pipelines separated by ;. Each stage's argv is a
+ * NULL terminated slice of one word array, so parsing allocates no memory
+ * per word. Redirections are kept beside the argv rather than in it */
+typedef struct _redirect {
+    char* files [3]; // for stdin, stdout and stderr, NULL when not redirected
+    bool append [3]; // >> and 2>>
+    signed char copies [3]; // N>&M: the descriptor M that N is made a copy of, -1 for none
+    bool copies_original [3]; // M was only redirected after N>&M, so N gets M as it was before
+} redirect;
+
+typedef struct _stage {
+    char** argv;
+    redirect io;
+} stage;
+
+typedef struct _pipeline {
+    stage* stages;
+    int num_stages;
+    char* text; // source text, used to name jobs and to queue the pipeline
+    int connector; // CONNECT_AND and CONNECT_OR run it only after a success or a failure
+    bool deferred; // has variables or glob patterns, so it is parsed again from text just before it runs
+} pipeline;
+
+typedef struct _parsed_line {
+    pipeline* pipelines;
+    int num_pipelines;
+} parsed_line;
+
+/* shell variables, hashed by name like the command cache. Exported ones also
+ * sit in a slot of the envp handed to exec, which is patched in place when
+ * one of them changes rather than rebuilt for every process started */
+#define VAR_TABLE_SIZE 256
+
+typedef struct _variable {
+    char* name;
+    char* entry; // "name=value", the value starts after the =
+    int env_slot; // index in envp, -1 when not exported
+    struct _variable *next;
+} variable;
+
+typedef struct _var_table {
+    variable* buckets [VAR_TABLE_SIZE];
+    char** envp; // NULL terminated, NULL until the table is loaded
+    variable** exported; // which variable is in each envp slot
+    int num_exported;
+    int envp_size;
+} var_table;
+
+/* glob expansion. Each directory a pipeline's patterns look in is read once
+ * and its entries sorted, so a pattern with a literal prefix such as data_17*
+ * only looks at the names that share the prefix. The listings are not kept
+ * past the pipeline, since any command may change a directory or the working
+ * directory. Everything lives in the line's arena */
+typedef struct _dir_entry {
+    char* name;
+    unsigned char type; // d_type, DT_UNKNOWN on file systems that leave it out
+} dir_entry;
+
+typedef struct _dir_listing {
+    char* path;
+    dir_entry* entries; // sorted by name
+    int count;
+    struct _dir_listing *next;
+} dir_listing;
+
+typedef struct _glob_state {
+    arena* a;
+    dir_listing* listings; // the directories read so far for this pipeline
+    char** matches;
+    int num_matches;
+    int matches_size;
+} glob_state;
+
+/* buffered line reader for the shell's input. Lines of any length are read
+ * with large block reads into one buffer that doubles when a line does not
+ * fit and is reused for every line. Comments are found in the same pass that
+ * looks for the newline, so the scan state is kept between reads */
+#define READ_BLOCK_SIZE 65536
+#define NO_COMMENT ((size_t) -1)
+
+typedef struct _line_reader {
+    int fd; // -1 when reading a buffer that is already in memory
+    char* buffer;
+    size_t size;
+    size_t start; // first byte of the current line
+    size_t end; // end of the data read so far
+    size_t scanned; // bytes of the current line scanned so far
+    char quote; // quote that is open where the scan stopped
+    bool escaped; // the next byte follows a backslash
+    size_t comment; // where the comment in the current line starts
+    bool eof;
+} line_reader;
+
+/* line editing on a terminal. While a line is edited the terminal is in raw
+ * mode and every key comes to the shell; the finished line goes to the line
+ * reader as if it had been read, and the terminal is back to normal for the
+ * commands it runs */
+#define COMPLETION_LIST_MAX 200 // candidates listed when tab can't pick one
+
+typedef struct _line_editor {
+    bool enabled; // stdin is a terminal
+    bool active; // a line is being edited, the terminal is raw
+    struct termios cooked; // the settings to go back to
+    char prompt [1100];
+    char* line;
+    size_t len;
+    size_t size;
+    size_t cursor;
+    long browsing; // history entry shown with the arrow keys, -1 when none
+    char* draft; // what was typed before browsing started
+    char escape [8]; // escape sequence read so far
+    int escape_len;
+    char pending [256]; // read after Enter, typed ahead for the next line
+    size_t pending_len;
+} line_editor;
+
+/* every executable on the path, for completing command names. The nodes sit
+ * in one array linked by first child and next sibling, siblings in byte order
+ * so a walk lists names sorted. It is built on the first tab and again only
+ * once a path directory has changed */
+typedef struct _trie_node {
+    int child; // -1 when none
+    int sibling;
+    unsigned char c;
+    bool terminal; // a name ends here
+} trie_node;
+
+typedef struct _command_trie {
+    trie_node* nodes; // nodes[0] is the root, NULL until it is built
+    int num_nodes;
+    int size;
+    char** dirs; // the path it was built from
+    struct timespec* mtimes;
+    int num_dirs;
+} command_trie;
+
+typedef struct _completions {
+    char** names; // sorted
+    int num_names; // at most COMPLETION_LIST_MAX for commands
+    int count; // every match
+    char* common; // the longest prefix they share
+} completions;
+
+/* things the main loop wakes up for. A burst of finished jobs is reported
+ * straight away but the prompt is only redrawn once the burst is over */
+#define EVENT_INPUT 1
+#define EVENT_CHILD 2
+#define EVENT_TIMER 4
+#define EVENT_WAIT  8
+#define PROMPT_DELAY_MS 20
+
+/* builtin commands run inside the shell process. The table is sorted by name
+ * so lookups are a binary search */
+typedef struct _builtin {
+    char* name;
+    int (*run)(char** params, path* head, program_state** p_state);
+    char* help;
+} builtin;
 
 typedef enum {RUNNING, PAUSED, DEAD} state;
 
+/* one step of a run-dag file. A step starts once every step it depends on
+ * has succeeded; when one fails, everything that depends on it is skipped */
+typedef enum {STEP_WAITING, STEP_RUNNING, STEP_DONE, STEP_FAILED, STEP_SKIPPED} step_state;
+
+/* a job the wait builtin is blocked on. Its pidfd sits in an epoll set, so a
+ * wakeup names the jobs that ended rather than every awaited pid being checked */
+typedef struct _waiter {
+    pid_t pid;
+    int pidfd; // -1 without pidfd_open, the job is then seen when it is reaped
+    int status;
+    bool done;
+} waiter;
+
 // doubly linked list for keeping track of history
 typedef struct _processes {
     struct _processes *previous;
     pid_t id;
     char prc_name [128];
     state process_state;
+    int exit_status;
+    bool reports_status; // false for pipeline stages other than the last, whose status is not the command's
+    struct timespec started; // for the wall clock time once it is reaped
+    waiter* waiter; // set while the wait builtin is blocked on the job
+    job_limits limits; // what it was started with, to tell when a limit killed it
+    uint64_t journal_id; // 0 unless it is journaled when it ends
+    int reply_fd; // the server client to send its status to, -1 for none
     struct _processes *next;
+    struct _processes *next_in_bucket; // chain in the pid index
 } processes;
 
+/* what a finished command cost, taken from wait4. The most recent ones are
+ * kept for jobs -v and the heaviest by cpu time for the batch summary */
+#define FINISHED_JOBS 64
+#define HEAVIEST_JOBS 5
+
+typedef struct _job_record {
+    pid_t id;
+    char name [128];
+    int exit_status;
+    double wall; // seconds from start until it was reaped
+    struct rusage usage;
+    char* limit_hit; // the limit that killed it, or NULL
+} job_record;
+
+/* shell overhead tracing. Each phase of running a command feeds a histogram
+ * with four buckets per power of two nanoseconds, so recording costs a clock
+ * read and an increment and a percentile is off by at most a quarter */
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef enum {PHASE_PARSE, PHASE_LOOKUP, PHASE_SPAWN, PHASE_RUN, PHASE_PROMPT, PHASE_OVERHEAD, NUM_PHASES} phase;
+
+typedef struct _histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets [HIST_BUCKETS];
+} histogram;
+
+typedef struct _dag_step {
+    char* name;
+    char* command;
+    char** needs; // names of the steps it depends on, from tokenify
+    int* dependents; // steps that depend on this one
+    int num_dependents;
+    int waiting; // dependencies that have not finished yet
+    step_state state;
+    waiter job; // filled in by finish_job
+} dag_step;
+
+/* captured output of one parallel job. Each stream is held in memory up to
+ * OUTPUT_BUDGET bytes; grouped output past that goes to an unlinked temp
+ * file until the job is done */
+#define OUTPUT_BUDGET (64 << 10)
+
+typedef struct _output_stream {
+    int fd; // read end of the job's pipe, -1 at end of file
+    int target; // STDOUT_FILENO or STDERR_FILENO
+    int mode; // OUTPUT_LINE or OUTPUT_GROUP, fixed when the job starts
+    char* buffer;
+    size_t len;
+    size_t size;
+    int spill_fd; // temp file for grouped output over the budget, -1 if none
+} output_stream;
+
+typedef struct _capture {
+    output_stream streams [2]; // stdout and stderr
+    struct _capture *next;
+} capture;
+
+/* what queued jobs are started with: the working directory and exported
+ * variables at the time they were queued. Jobs queued between two cd's or
+ * changes to exported variables share one */
+typedef struct _job_context {
+    int cwd_fd; // -1 if the directory could not be opened, the job then runs where the shell is
+    char** envp; // a copy, the pointers and strings in one allocation
+    int refs;
+} job_context;
+
+/* parallel commands that are waiting for a free job slot, first in first out.
+ * They are queued expanded, so they run with the variables and files of the
+ * moment their line reached them and not of the moment a slot frees up */
+typedef struct _queued_job {
+    pipeline* command; // a copy in one allocation, see pack_pipeline
+    job_context* context;
+    uint64_t journal_id; // worked out when it was queued, see journal_id
+    struct _queued_job *next;
+} queued_job;
+
+/* a journal of the commands a script or batch run has finished, so a run that
+ * died can be started again without repeating them. A command is known by an
+ * FNV-1a hash of its text and of how often the same text came before it, so
+ * editing one line of a script leaves the others matching. Each entry is
+ * written as its job ends, which survives the shell dying; fdatasync only
+ * runs every JOURNAL_SYNC_ENTRIES entries or JOURNAL_SYNC_MS, which bounds
+ * what a machine crash can lose */
+#define JOURNAL_SYNC_ENTRIES 64
+#define JOURNAL_SYNC_MS 1000
+
+typedef struct _journal_slot {
+    uint64_t key; // 0 for an empty slot
+    uint64_t value;
+} journal_slot;
+
+typedef struct _journal {
+    int fd; // -1 when there is no journal
+    journal_slot* done; // ids that succeeded in an earlier run, open addressing
+    size_t done_size;
+    size_t num_done;
+    journal_slot* seen; // hash of a command's text to the times it has come up
+    size_t seen_size;
+    size_t num_seen;
+    int unsynced; // entries written since the last fdatasync
+    uint64_t synced_ns;
+    long skipped;
+} journal;
+
+/* jobs are also indexed by pid so that adding, finding and removing one does
+ * not walk the whole list */
+#define JOB_INDEX_SIZE 4096
+
 processes* head_jobs;
-bool shell_printed = false;
+processes* tail_jobs;
+processes* job_index [JOB_INDEX_SIZE];
+queued_job* head_queue;
+queued_job* tail_queue;
+int queue_depth = 0;
+job_context* queue_context = NULL; // given to the jobs queued until the next cd or export
+job_context* running_context = NULL; // the one of the queued job being started, for exec_environment
+job_record finished_jobs [FINISHED_JOBS]; // ring, newest at num_finished - 1
+long num_finished = 0;
+job_record heaviest_jobs [HEAVIEST_JOBS]; // most cpu time first
+int num_heaviest = 0;
+job_record last_job; // the last command waited for in the foreground, for time
+histogram phase_stats [NUM_PHASES];
+char* phase_names [] = {"parse", "lookup", "spawn", "run", "prompt", "overhead"};
+uint64_t foreground_wait_ns = 0; // time spent blocked on foreground children, left out of overhead
+char* stats_file = NULL; // -S, where the histograms are written at exit
+arena line_arena; // reset after every line
+long commands_run = 0; // counted for the batch mode summary
+long commands_failed = 0;
+journal run_journal = {-1, NULL, 0, 0, NULL, 0, 0, 0, 0, 0};
+uint64_t current_journal_id = 0; // given to the jobs run_command starts
+int reply_fd = -1; // the client being served, every command's status goes back on it
+int sigchld_pipe [2] = {-1, -1}; // the SIGCHLD handler writes a byte here so the main loop knows to reap
+history shell_history;
+cmd_cache command_cache;
+var_table variables;
+line_editor editor;
+command_trie command_names;
+int spawn_backend = 1; // SPAWN_POSIX
+int output_mode = 0; // OUTPUT_DIRECT
+capture* head_captures = NULL;
+int num_captures = 0;
+struct pollfd* event_fds = NULL; // grows with the number of captured streams
+int event_fds_size = 0;
+int pipe_buffer_size = 0; // size requested for pipeline pipes with F_SETPIPE_SZ, 0 keeps the kernel default
+bool prompt_pending = false; // jobs were reported since the prompt was last shown
+int timer_fd = -1; // one shot timer that redraws the prompt
+int wait_fd = -1; // epoll set of the pidfds wait is blocked on, -1 when not waiting
+int jobs_awaited = 0;
+waiter* last_awaited = NULL; // the awaited job that finished most recently
+bool interactive = false; // prompts and job notifications are only shown on a terminal
+extern char** environ;
 
 /*_________________________________________________________*
  *           Functions for initialising the shell          *
  *_________________________________________________________*/
-int run_shell(path* head);
+int run_shell(path* head, int input, char* command_string, program_state* p_state);
+int run_batch(path* head, char* filename, program_state* p_state);
+int run_server(path* head, char* socket_path, program_state* p_state);
+void init_jobs();
+void free_jobs();
+void apply_mode(program_state** p_state);
+void wait_for_slot(path* head, program_state** p_state);
+program_state* new_program_state();
+void free_program_state(program_state* p_state);
+void run_line(char* buffer, path* head, program_state** p_state);
+void wait_for_jobs(path* head, program_state** p_state);
+int wait_for_events(int input_fd);
+void handle_events(int events, line_reader* reader, path* head, program_state** p_state);
+void init_events();
+void free_events();
+void set_timer(int ms);
+void reap_children();
+void finish_job(processes* job, int status, struct rusage* usage);
 int _inc_jobs(int n);
 void show_prompt();
-void poll_results();
-void sig_comm();
+void sig_comm(int sig);
 path* load_environment(); //sets envronment from computer's $PATH variable
 path* load_path_from_list(char** environment); //helper function for load_environment
 path *load_path(const char *filename); //load path from file
 void free_path(path* head);
 
+/*_________________________________________________________*
+ *           Functions for reading input lines             *
+ *_________________________________________________________*/
+void init_reader(line_reader* reader, int fd);
+void wrap_reader(line_reader* reader, char* data, size_t len);
+void free_reader(line_reader* reader);
+char* read_line(line_reader* reader);
+bool next_line(line_reader* reader, size_t* start, size_t* len);
+bool scan_line(line_reader* reader);
+bool fill_reader(line_reader* reader);
+bool line_ready(line_reader* reader);
+void compact_reader(line_reader* reader, size_t room);
+void feed_reader(line_reader* reader, char* data, size_t len);
+
+/*_________________________________________________________*
+ *           Functions for editing lines                   *
+ *_________________________________________________________*/
+void init_editor();
+void free_editor();
+void raw_mode(bool on);
+void edit_prompt(char* prompt);
+void edit_input(line_reader* reader, path* head);
+bool edit_escape(char c);
+void edit_key(char c, line_reader* reader, path* head);
+void finish_edit(line_reader* reader);
+void refresh_line();
+void write_terminal(char* text, size_t len);
+void insert_text(char* text, size_t len);
+void delete_text(size_t from, size_t to);
+size_t previous_char(size_t pos);
+size_t next_char(size_t pos);
+void browse_history(int direction);
+void complete_word(path* head);
+void list_completions(completions* c);
+
+/*_________________________________________________________*
+ *           Functions for completion                      *
+ *_________________________________________________________*/
+bool trie_stale(path* head);
+void build_trie(path* head);
+void free_trie();
+void trie_insert(char* name);
+int trie_find(char* prefix);
+void trie_collect(int node, char* name, size_t len, completions* c);
+void complete_command(char* prefix, path* head, completions* c);
+void complete_file(char* word, completions* c);
+void add_completion(completions* c, char* name, bool keep);
+void free_completions(completions* c);
+int compare_names(const void* a, const void* b);
+
 /*_________________________________________________________*
  *           Functions for parsing input                   *
  *_________________________________________________________*/
 char** tokenify(char* buffer, char* split);
-char** splitCommands(char* buffer);
+parsed_line* parse_line(arena* a, char* line, bool expand);
 char* is_valid_command(char* command, path* head);
-void remove_comments(char* buffer);
 bool is_built_in_command(char* command);
-void run_builtin(char** params, char* buffer, program_state** p_state);
+bool runs_builtin(char** params);
+builtin* find_builtin(char* command);
+int compare_builtin(const void* name, const void* entry);
+int run_builtin(char** params, path* head, program_state** p_state);
+int run_redirected_builtin(char** params, redirect* io, path* head, program_state** p_state);
+
+/*_________________________________________________________*
+ *           Functions for shell variables                 *
+ *_________________________________________________________*/
+void init_variables();
+void free_variables();
+variable* find_variable(char* name, size_t len);
+char* get_variable(char* name);
+void set_variable(char* name, size_t len, char* value, bool export);
+void export_variable(variable* var);
+void unset_variable(char* name);
+size_t variable_name_length(char* name);
+bool is_assignment(char* word);
+bool assign_variable(char* assignment, bool export, path* head);
+char* variable_at(char* src, char** end);
+char* copy_value(char* dst, char* value, bool* escaped);
+char* grow_word(arena* a, char** word, char* dst, char** out_end, size_t needed);
+char** exec_environment();
+void reload_path(path* head);
+
+/*_________________________________________________________*
+ *           Functions for glob expansion                  *
+ *_________________________________________________________*/
+char** expand_globs(arena* a, char** words, int* num_words, bool* patterns, int* stage_starts, int num_stages);
+void expand_pattern(glob_state* g, char* pattern);
+void glob_dir(glob_state* g, char* prefix, char* rest);
+dir_listing* list_directory(glob_state* g, char* path);
+int compare_entries(const void* a, const void* b);
+int compare_matches(const void* a, const void* b);
+void add_match(glob_state* g, char* match);
+bool match_glob(char* pattern, char* name);
+int match_bracket(char* pattern, char c, char** end);
+char* unescape_word(char* word);
+
+/*_________________________________________________________*
+ *           Functions for the per-line arena              *
+ *_________________________________________________________*/
+void* arena_alloc(arena* a, size_t size);
+void* arena_grow(arena* a, void* old, size_t old_size, size_t new_size);
+void arena_reset(arena* a);
+void arena_free(arena* a);
+arena* arena_create();
+void arena_destroy(arena* a);
+
+/*_________________________________________________________*
+ *           Functions for the command lookup cache        *
+ *_________________________________________________________*/
+unsigned int hash_command(char* command);
+cmd_cache_entry* find_cached_command(char* command);
+void cache_command(char* command, char* full_path);
+void clear_command_cache();
+bool path_dir_changed(path* dir);
+bool path_changed(path* head);
+
+/*_________________________________________________________*
+ *           Builtin commands                              *
+ *_________________________________________________________*/
+int builtin_cat(char** params, path* head, program_state** p_state);
+int builtin_cd(char** params, path* head, program_state** p_state);
+int builtin_echo(char** params, path* head, program_state** p_state);
+int builtin_exit(char** params, path* head, program_state** p_state);
+int builtin_export(char** params, path* head, program_state** p_state);
+int builtin_hash(char** params, path* head, program_state** p_state);
+int builtin_help(char** params, path* head, program_state** p_state);
+int builtin_history(char** params, path* head, program_state** p_state);
+int builtin_jobs(char** params, path* head, program_state** p_state);
+int builtin_limit(char** params, path* head, program_state** p_state);
+int builtin_mode(char** params, path* head, program_state** p_state);
+int builtin_output(char** params, path* head, program_state** p_state);
+int builtin_pause(char** params, path* head, program_state** p_state);
+int builtin_pipesize(char** params, path* head, program_state** p_state);
+int builtin_pwd(char** params, path* head, program_state** p_state);
+int builtin_resume(char** params, path* head, program_state** p_state);
+int builtin_run_dag(char** params, path* head, program_state** p_state);
+int builtin_tee(char** params, path* head, program_state** p_state);
+int builtin_stats(char** params, path* head, program_state** p_state);
+int builtin_time(char** params, path* head, program_state** p_state);
+int builtin_wait(char** params, path* head, program_state** p_state);
+int builtin_type(char** params, path* head, program_state** p_state);
+int builtin_unset(char** params, path* head, program_state** p_state);
+
+/*_________________________________________________________*
+ *           Functions for the command history             *
+ *_________________________________________________________*/
+void init_history();
+void free_history();
+void add_history(char* command);
+bool grow_history(size_t size);
+void index_history();
+history_header* history_head();
+char* history_text(history_entry* entry);
+history_entry* history_at(long index);
+long history_number(long index);
+history_entry* find_history(long number);
+history_entry* find_history_prefix(char* prefix, size_t len);
+long find_history_offset(size_t offset);
+char* expand_history(arena* a, char* line);
+void print_history_entry(long index);
 
 /*_________________________________________________________*
  *           Functions for running shell commands          *
  *_________________________________________________________*/
-void run_commands(char** commands, path* head, program_state** p_state);
-void execute_command(char** params, char* commands, path* head, program_state** p_state);
+void run_commands(parsed_line* line, path* head, program_state** p_state);
+pipeline* expand_pipeline(pipeline* command, program_state** p_state);
+void run_command(pipeline* command, path* head, program_state** p_state);
+bool is_builtin_pipeline(pipeline* command);
+int execute_command(char** params, redirect* io, char* commands, path* head, program_state** p_state);
+int execute_pipeline(pipeline* command, path* head, program_state** p_state);
+pid_t launch_process(char** params, int* fds, job_limits* limits, int* exec_errno);
+pid_t fork_process(char** params, int* fds, job_limits* limits, int* exec_errno, sigset_t* child_mask);
+pid_t spawn_process(char** params, int* fds, int* exec_errno, sigset_t* child_mask);
+pid_t fork_builtin(char** params, int* fds, path* head, program_state** p_state);
+void redirect_stdio(int* fds);
+void stdio_order(int* fds, int* order);
+bool open_redirects(redirect* io, int* fds);
+bool redirected(redirect* io, int fd);
+void close_redirects(redirect* io, int* fds);
+bool set_spawn_backend(char* name);
+int make_pipe(int* pipefd);
+bool relay_fd(int in_fd, int out_fd);
+bool tee_fd(int in_fd, int out_fd, int* files, int num_files);
+bool splice_all(int in_fd, int out_fd, size_t len);
+bool write_chunk(int in_fd, size_t len, size_t done, int* files, int num_files);
+bool copy_fd(int in_fd, int out_fd);
+bool write_all(int fd, char* buffer, size_t len);
 char* previous_directory(char* dir);
 void change_directory(char* dir);
 bool change_mode(char* mode_str, program_state** p_state);
 void print_processes(processes* head);
 void pause_process(char* id);
 void resume_process(char* id);
-void run_from_system(char* buffer, program_state* p_state);
-void manage_state();
+void manage_state(path* head, program_state** p_state);
 void set_process_state(pid_t pid, state process_state);
+processes* find_process(pid_t pid);
+
+/*_________________________________________________________*
+ *           Functions for scheduling parallel jobs        *
+ *_________________________________________________________*/
+bool job_slot_free(program_state** p_state);
+void enqueue_job(pipeline* command, uint64_t journal_id);
+pipeline* pack_pipeline(pipeline* command);
+job_context* share_queue_context();
+void drop_queue_context();
+void release_context(job_context* context);
+char** copy_environment(char** envp);
+int enter_context(job_context* context);
+void leave_context(int cwd_fd);
+void schedule_jobs(path* head, program_state** p_state);
+void place_job(pid_t pid, program_state** p_state);
+void print_queue();
+
+/*_________________________________________________________*
+ *           Functions for waiting on jobs                 *
+ *_________________________________________________________*/
+int await_jobs(waiter* waiters, int count, bool any, path* head, program_state** p_state);
+void collect_awaited();
+int finished_status(pid_t pid);
+
+/*_________________________________________________________*
+ *           Functions for running dependency graphs       *
+ *_________________________________________________________*/
+dag_step* read_dag(char* filename, int* num_steps);
+bool link_dag(dag_step* steps, int num_steps);
+int compare_steps(const void* a, const void* b);
+int run_dag(dag_step* steps, int num_steps, int max_jobs, path* head, program_state** p_state);
+bool start_step(dag_step* step, path* head, program_state** p_state);
+int skip_dependents(dag_step* steps, int failed);
+void free_dag(dag_step* steps, int num_steps);
+void forget_jobs();
+
+/*_________________________________________________________*
+ *           Functions for job resource accounting         *
+ *_________________________________________________________*/
+void record_job(pid_t pid, char* name, int status, struct timespec* started, struct rusage* usage, char* limit_hit);
+void add_usage(struct rusage* total, struct rusage* part);
+double cpu_seconds(struct rusage* usage);
+double seconds_since(struct timespec* start);
+void print_job_record(job_record* record);
+bool read_proc_usage(pid_t pid, double* user, double* sys, long* rss);
+void print_heaviest_jobs();
+
+/*_________________________________________________________*
+ *           Functions for job resource limits             *
+ *_________________________________________________________*/
+void clear_limits(job_limits* limits);
+bool limits_active(job_limits* limits);
+int limited_command(char** params);
+int parse_limits(char** params, job_limits* limits);
+bool parse_rlimit(char* value, rlim_t scale, rlim_t* limit);
+bool parse_io_priority(char* value, job_limits* limits);
+char** strip_limits(char** params, job_limits* limits);
+int apply_limits(job_limits* limits);
+char* limit_hit(int status, struct rusage* usage, job_limits* limits);
+void describe_limits(job_limits* limits, char* out, size_t size);
+
+/*_________________________________________________________*
+ *           Functions for the run journal                 *
+ *_________________________________________________________*/
+bool open_journal(char* filename);
+void close_journal();
+uint64_t fnv_hash(uint64_t hash, void* data, size_t len);
+journal_slot* journal_lookup(journal_slot** table, size_t* size, size_t* used, uint64_t key, bool insert);
+uint64_t journal_id(char* command);
+bool journal_done(uint64_t id);
+bool reruns_on_resume(pipeline* command);
+void journal_result(uint64_t id, int status, char* command);
+
+/*_________________________________________________________*
+ *           Functions for capturing parallel output       *
+ *_________________________________________________________*/
+bool set_output_mode(char* name);
+bool start_capture(int* fds);
+void end_capture_setup(int* fds);
+int capture_poll_fds(struct pollfd* pfd);
+void read_captures(struct pollfd* pfd);
+void read_stream(output_stream* stream);
+void append_stream(output_stream* stream, char* data, size_t len);
+void flush_stream(output_stream* stream);
+void finish_captures();
+
+/*_________________________________________________________*
+ *           Functions for server mode                     *
+ *_________________________________________________________*/
+void serve_client(int conn, path* head, program_state** p_state);
+bool stale_socket(struct sockaddr_un* address);
+bool receive_stdio(int conn, int* fds);
+void send_reply(int fd, int status, double seconds);
+void ignore_signal(int sig);
+
+/*_________________________________________________________*
+ *           Functions for shell overhead tracing          *
+ *_________________________________________________________*/
+uint64_t now_ns();
+void record_phase(phase p, uint64_t start);
+void record_phase_ns(phase p, uint64_t ns);
+int histogram_bucket(uint64_t ns);
+uint64_t bucket_limit(int bucket);
+uint64_t histogram_percentile(histogram* h, double fraction);
+void write_stats(FILE* out);
+void dump_stats();
 
 /*_________________________________________________________*
  *           Functions cleaning up and debugging           *
  *_________________________________________________________*/
 void print_path(path* head, int num_words); //debugging
 void list_clear(path *list);
-void clean_up_processes(); // defensive mechanism because delete is asynchronous
 path* list_append(char* curr, path *list);
 void free_tokens(char** tokens);
-void add_process(pid_t pid, char* process_name);
+processes* add_process(pid_t pid, char* process_name);
 void delete_process(pid_t id);
-void delete_process_by_name(char* process_name);
 
-int main() {
-    system("reset"); //run reset in parallel to reduce lag time (removed ampersand because the behaviour was inconsistent)
-    printf("%c]0;%s%c", '\033', "Shelby the Shell", '\007'); // window title
+#ifndef NO_SHELL_MAIN
+int main(int argc, char** argv) {
+    int opt;
+    char* command_string = NULL;
+    char* batch_file = NULL;
+    char* socket_path = NULL;
+    char* journal_file = NULL;
+    program_state* p_state = new_program_state();
+    init_variables();
+    while ((opt = getopt(argc, argv, "s:c:j:apf:S:o:L:J:")) != -1) {
+        if (opt == 's' && set_spawn_backend(optarg)) continue;
+        if (opt == 'o' && set_output_mode(optarg)) continue;
+        if (opt == 'c') {
+            command_string = optarg;
+            continue;
+        }
+        if (opt == 'j' && strtol(optarg, NULL, 10) > 0) {
+            p_state->max_jobs = strtol(optarg, NULL, 10);
+            continue;
+        }
+        if (opt == 'a') {
+            p_state->pin_cpus = true;
+            continue;
+        }
+        if (opt == 'p') {
+            p_state->in_parallel = true;
+            p_state->mode = PARALLEL;
+            continue;
+        }
+        if (opt == 'f') {
+            batch_file = optarg;
+            continue;
+        }
+        if (opt == 'S') {
+            stats_file = optarg;
+            continue;
+        }
+        if (opt == 'L') {
+            socket_path = optarg;
+            continue;
+        }
+        if (opt == 'J') {
+            journal_file = optarg;
+            continue;
+        }
+        fprintf(stderr, "Usage: %s [-s fork|spawn] [-j max jobs] [-a] [-p] [-S stats file] [-o direct|line|group] [-J journal] [-c command | -f batch file | -L socket | script]\n", argv[0]);
+        return 1;
+    }
+    if (journal_file != NULL && batch_file == NULL && optind >= argc) {
+        fprintf(stderr, "-J needs a script or a -f batch file to journal.\n");
+        return 1;
+    }
+    if (journal_file != NULL && !open_journal(journal_file)) return 1;
+    
+    if (batch_file != NULL || socket_path != NULL) {
+        path* head = load_environment();
+        int res = batch_file != NULL ? run_batch(head, batch_file, p_state) : run_server(head, socket_path, p_state);
+        dump_stats();
+        free_program_state(p_state);
+        free_path(head);
+        clear_command_cache();
+        free_variables();
+        close_journal();
+        return res;
+    }
+    
+    int input = STDIN_FILENO;
+    if (command_string == NULL && optind < argc) {
+        input = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (input < 0) {
+            fprintf(stderr, "Failed to open %s: %s.\n", argv[optind], strerror(errno));
+            return 127;
+        }
+    }
+    
+    interactive = command_string == NULL && input == STDIN_FILENO && isatty(STDIN_FILENO);
+    if (interactive) {
+        printf("%cc", '\033'); // reset the terminal ourselves rather than starting reset(1)
+        printf("%c]0;%s%c", '\033', "Shelby the Shell", '\007'); // window title
+    }
     path* head = load_environment();
     //path* head = load_path("shell-config");
-    int res = run_shell(head);	
+    int res = run_shell(head, input, command_string, p_state);	
+    dump_stats();
+    free_program_state(p_state);
+    if (input != STDIN_FILENO) close(input);
     free_path(head);
+    clear_command_cache();
+    free_variables();
+    close_journal();
     return res;
 }
+#endif
 
 /* run shell contains a loop that gets user input and then runs the appropriate file
  * exits when user types "exit" or presses ctrl + d to signify the end of the fil
- * The signal listener is initialised so the processes can be updated asynchronously */
-int run_shell(path* head) {
-    // initialisation
-    program_state* p_state = (program_state*) calloc(1, sizeof(program_state));
-    p_state->do_exit = false;
-    p_state->in_parallel = false;
-    p_state->mode = SEQUENTIAL;
+ * The signal listener is initialised so the processes can be updated asynchronously.
+ * With a command string (-c) only that line is run. Scripts and -c wait for
+ * their background jobs before returning the last command's status */
+int run_shell(path* head, int input, char* command_string, program_state* p_state) {
+    line_reader reader;
+    init_reader(&reader, input);
+    init_jobs();
+    init_events();
+    if (interactive) init_history();
+    if (interactive) init_editor();
+    
+    if (command_string != NULL) {
+        // every line of the string, split and stripped of comments as a script's are
+        line_reader lines;
+        size_t start, len;
+        wrap_reader(&lines, command_string, strlen(command_string));
+        while (!p_state->do_exit && next_line(&lines, &start, &len)) {
+            command_string[start + len] = '\0';
+            run_line(command_string + start, head, &p_state);
+            reap_children();
+            schedule_jobs(head, &p_state);
+            apply_mode(&p_state);
+        }
+        reader.eof = true;
+    } else show_prompt();
+    
+    /* every complete line runs as soon as it is read; otherwise the loop sleeps
+     * until there is more input, a child has exited or the prompt timer fires */
+    while (!p_state->do_exit) {
+        if (line_ready(&reader)) {
+            run_line(read_line(&reader), head, &p_state);
+            if (p_state->do_exit) break; //check background
+            manage_state(head, &p_state);
+            continue;
+        }
+        if (reader.eof) break; // end of input, jobs are collected below
+        if (editor.pending_len > 0) { // typed ahead while the last line ran, it is not waiting in stdin
+            edit_input(&reader, head);
+            continue;
+        }
+        handle_events(wait_for_events(reader.fd), &reader, head, &p_state);
+    }
+    if ((_inc_jobs(0) > 0 || queue_depth > 0) && interactive) printf("\nWaiting for the running processes to finish.\n");
+    wait_for_jobs(head, &p_state);
+    int status = p_state->last_status;
+    free_events();
+    free_jobs();
+    free_history();
+    free_editor();
+    free_trie();
+    free_reader(&reader);
+    return status;
+}
+
+/* batch mode (-f) runs a command file with no prompt and finishes with a
+ * summary on stderr. Regular files are memory mapped and scanned in place.
+ * In parallel mode lines are only read as job slots free up, so the queue
+ * never holds more than one line however long the file is */
+int run_batch(path* head, char* filename, program_state* p_state) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s.\n", filename, strerror(errno));
+        return 127;
+    }
+    
+    struct stat statresult;
+    char* data = NULL;
+    size_t size = 0;
+    line_reader reader;
+    if (fstat(fd, &statresult) == 0 && S_ISREG(statresult.st_mode) && statresult.st_size > 0) {
+        data = mmap(NULL, statresult.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+        else {
+            size = statresult.st_size;
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+    }
+    if (data != NULL) wrap_reader(&reader, data, size); // scanned in place, lines are copied out
+    else init_reader(&reader, fd); // a pipe or similar, read it in blocks
+    
+    init_jobs();
+    init_events();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    while (!p_state->do_exit) {
+        if (data != NULL) {
+            size_t start, len;
+            if (!next_line(&reader, &start, &len)) break;
+            if (len + 1 > line_size) {
+                line_size = (len + 1) * 2;
+                line = realloc(line, line_size);
+            }
+            memcpy(line, data + start, len);
+            line[len] = '\0';
+        } else if ((line = read_line(&reader)) == NULL) break;
+        
+        if (p_state->mode == PARALLEL) wait_for_slot(head, &p_state);
+        run_line(line, head, &p_state);
+        reap_children();
+        schedule_jobs(head, &p_state);
+        apply_mode(&p_state);
+    }
+    wait_for_jobs(head, &p_state);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld commands, %ld failed, %.3f s, %.1f commands/sec.\n",
+            commands_run, commands_failed, elapsed, elapsed > 0 ? commands_run / elapsed : 0.0);
+    print_heaviest_jobs();
+    
+    if (data != NULL) {
+        free(line);
+        munmap(data, size);
+    } else free_reader(&reader);
+    free_events();
+    free_jobs();
+    close(fd);
+    return commands_failed > 0 ? 1 : 0;
+}
+
+/* server mode (-L) keeps one shell running behind a Unix domain socket, so a
+ * caller that runs many short batches pays for startup and a cold command
+ * cache once. Clients are served one at a time and share the shell's state:
+ * the working directory, mode and caches carry over from one to the next */
+int run_server(path* head, char* socket_path, program_state* p_state) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+    if (!stale_socket(&address)) return 1;
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077); // whoever can connect can run commands as us
+    bool bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s.\n", socket_path, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        if (bound) unlink(socket_path);
+        return 1;
+    }
+    
+    /* a client that goes away must not take the server with it. A handler
+     * rather than SIG_IGN, which programs started by the shell would inherit */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = ignore_signal;
+    sigaction(SIGPIPE, &action, NULL);
+    init_jobs();
+    init_events();
+    while (!p_state->do_exit) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0 && errno == EINTR) continue;
+        if (conn < 0) {
+            fprintf(stderr, "Failed to accept a client: %s.\n", strerror(errno));
+            break;
+        }
+        serve_client(conn, head, &p_state);
+        close(conn);
+    }
+    free_events();
+    free_jobs();
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+/* a client first sends one byte carrying its stdin, stdout and stderr, which
+ * stand in for the shell's own while it is served, so commands read and write
+ * the client's files directly. Then it sends lines of commands; each gets a
+ * "status seconds" line back once it has run. The connection is closed when
+ * the client has sent everything and its jobs have finished */
+void serve_client(int conn, path* head, program_state** p_state) {
+    int fds[3], saved[3], i;
+    if (!receive_stdio(conn, fds)) return;
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    
+    line_reader reader;
+    init_reader(&reader, conn);
+    reply_fd = conn;
+    while (!(*p_state)->do_exit) {
+        if (line_ready(&reader)) {
+            run_line(read_line(&reader), head, p_state);
+            if (reply_fd < 0) break; // the client is gone
+            reap_children();
+            schedule_jobs(head, p_state);
+            apply_mode(p_state);
+            continue;
+        }
+        if (reader.eof) break;
+        handle_events(wait_for_events(reader.fd), &reader, head, p_state);
+    }
+    wait_for_jobs(head, p_state); // their replies are the last ones
+    reply_fd = -1;
+    free_reader(&reader);
+    
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+}
+
+// the first byte from a client, with its three descriptors attached
+bool receive_stdio(int conn, int* fds) {
+    char byte;
+    struct iovec data = {&byte, 1};
+    union {
+        char buffer [CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(conn, &message, MSG_CMSG_CLOEXEC) != 1) return false;
+    
+    // the buffer only has room for three, the kernel drops any more
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    int count = 0, i;
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+    }
+    if (count == 3) return true;
+    for (i = 0; i < count; i++) close(fds[i]);
+    fprintf(stderr, "A client connected without passing its stdin, stdout and stderr.\n");
+    return false;
+}
+
+/* clears the way for bind. Only a socket left behind by a server that is gone
+ * is removed; any other file, or a socket a live server still answers on, is
+ * reported and kept */
+bool stale_socket(struct sockaddr_un* address) {
+    struct stat info;
+    if (lstat(address->sun_path, &info) < 0) return true; // nothing there
+    if (!S_ISSOCK(info.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket.\n", address->sun_path);
+        return false;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 && connect(probe, (struct sockaddr*) address, sizeof(*address)) == 0;
+    if (probe >= 0) close(probe);
+    if (live) {
+        fprintf(stderr, "A server is already listening on %s.\n", address->sun_path);
+        return false;
+    }
+    unlink(address->sun_path);
+    return true;
+}
+
+/* one reply per command: its status and how long it ran. Commands started in
+ * parallel send theirs from finish_job once they are reaped */
+void send_reply(int fd, int status, double seconds) {
+    fflush(stdout); // the shell's own messages come before the status
+    char reply [64];
+    int len = snprintf(reply, sizeof(reply), "%d %.6f\n", status, seconds);
+    if (send(fd, reply, len, MSG_NOSIGNAL) < 0 && fd == reply_fd) reply_fd = -1;
+}
+
+void ignore_signal(int sig) {
+}
+
+/* sets up the job list and the SIGCHLD handler. The handler only pokes a
+ * pipe; children are reaped by the main loop, which can safely print and
+ * touch the job list */
+void init_jobs() {
     head_jobs = (processes*) calloc(1, sizeof(processes));
     head_jobs->next = NULL;
     head_jobs->previous = NULL;
-    show_prompt();
-    signal(SIGCHLD, sig_comm); //signal handler notifies user asynchronously. I like that feature better than the waitpid notification after input so I'll run both in tandem
-    while(!feof(stdin) || _inc_jobs(0) != 0) {
-        char buffer [1024];
-        shell_printed = false;
-	    if (fgets(buffer, 1024, stdin) != NULL) {
-	        remove_comments(buffer);
-	        char** commands = splitCommands(buffer);
-            run_commands(commands, head, &p_state);
-	        free_tokens(commands); 
-	    } else continue; 
-	    if (p_state->do_exit) break; //check background
-	      
-	    if (feof(stdin)) printf("\nYou cannot exit while there are processes running.\n"); //unindented single line if statements help make the code readable for me
-	    manage_state(&p_state);   
-    }
-    free(p_state);
+    tail_jobs = head_jobs;
+    
+    pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sig_comm;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+void free_jobs() {
+    signal(SIGCHLD, SIG_DFL);
     free(head_jobs);
-    return 0;
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    arena_free(&line_arena);
+    drop_queue_context();
 }
 
-void manage_state(program_state** p_state) {
-    //change mode
-    //if signal handler fails clean with wait
-    clean_up_processes(); // collect zombie children if not caught by signal wait. chains of short commands had this problem
-    shell_printed = false;
+// mode changes take effect once the line that asked for them is finished
+void apply_mode(program_state** p_state) {
     if ((*p_state)->in_parallel) (*p_state)->mode = PARALLEL;
     else (*p_state)->mode = SEQUENTIAL; 
+}
+
+// blocks until a parallel job could start without being queued
+void wait_for_slot(path* head, program_state** p_state) {
+    while (!job_slot_free(p_state)) {
+        if (!(wait_for_events(-1) & EVENT_CHILD)) continue;
+        reap_children();
+        schedule_jobs(head, p_state);
+    }
+}
+
+program_state* new_program_state() {
+    program_state* p_state = (program_state*) calloc(1, sizeof(program_state));
+    p_state->do_exit = false;
+    p_state->in_parallel = false;
+    p_state->mode = SEQUENTIAL;
+    p_state->max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (p_state->max_jobs < 1) p_state->max_jobs = 1;
+    clear_limits(&p_state->limits);
     
-    if ((*p_state)->mode == PARALLEL) {
-        poll_results(); //using this as a non-blocking wait
-        if (shell_printed == false) show_prompt();
-    	shell_printed = true;
-    } else show_prompt();
+    // remember which cpus we are allowed on so pinned jobs stay inside any cpuset we were given
+    cpu_set_t allowed;
+    int cpu;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        p_state->cpus = calloc(CPU_COUNT(&allowed), sizeof(int));
+        for (cpu = 0; cpu < CPU_SETSIZE && p_state->cpus != NULL; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) p_state->cpus[p_state->num_cpus++] = cpu;
+        }
+    }
+    return p_state;
 }
 
-void clean_up_processes() {
-    if (_inc_jobs(0) > 0) {
-		int pid = waitpid(-1, NULL, WNOHANG); //non-blocking wait
-		while (pid > 0) {	
-			printf("\nProcess %d finished running.\n", pid);
-			shell_printed = true;
-            show_prompt();
-			delete_process(pid);
-			pid = waitpid(-1, NULL, WNOHANG);
-		}
-	} //only ran on the next command input so I used it in conjunction with signal
+void free_program_state(program_state* p_state) {
+    free(p_state->cpus);
+    free(p_state);
+}
+
+/* lines arrive with comments already removed by the reader. On a terminal
+ * history events are expanded first and the line that runs is the one that
+ * goes into the history, as in bash */
+void run_line(char* buffer, path* head, program_state** p_state) {
+    if (interactive) {
+        char* expanded = expand_history(&line_arena, buffer);
+        if (expanded == NULL) {
+            (*p_state)->last_status = 1;
+            arena_reset(&line_arena);
+            return;
+        }
+        if (expanded != buffer) printf("%s\n", expanded);
+        buffer = expanded;
+        add_history(buffer);
+    }
+    uint64_t start = now_ns();
+    parsed_line* line = parse_line(&line_arena, buffer, false);
+    record_phase(PHASE_PARSE, start);
+    command_cache.checked = false;
+    if (line == NULL) {
+        (*p_state)->last_status = 2;
+        commands_run++;
+        commands_failed++;
+        if (reply_fd >= 0) send_reply(reply_fd, 2, 0);
+    } else {
+        run_commands(line, head, p_state);
+    }
+    arena_reset(&line_arena);
+}
+
+/* blocks until every background job, queued ones included, has finished,
+ * then writes out whatever output they left behind */
+void wait_for_jobs(path* head, program_state** p_state) {
+    reap_children();
+    schedule_jobs(head, p_state);
+    while (_inc_jobs(0) > 0) {
+        if (!(wait_for_events(-1) & EVENT_CHILD)) continue;
+        reap_children();
+        schedule_jobs(head, p_state);
+    }
+    finish_captures();
+}
+
+/* blocks until the input is readable, a child has exited, the timer has
+ * fired, an awaited job has ended or a captured job has written something.
+ * Captured output is dealt with here; the other events are returned. Zero if
+ * poll was interrupted. An input_fd of -1 waits without input */
+int wait_for_events(int input_fd) {
+    if (4 + 2 * num_captures > event_fds_size) {
+        event_fds_size = (4 + 2 * num_captures) * 2;
+        event_fds = (struct pollfd*) realloc(event_fds, event_fds_size * sizeof(struct pollfd));
+    }
+    struct pollfd* pfd = event_fds;
+    pfd[0] = (struct pollfd) {input_fd, POLLIN, 0};
+    pfd[1] = (struct pollfd) {sigchld_pipe[0], POLLIN, 0};
+    pfd[2] = (struct pollfd) {timer_fd, POLLIN, 0}; // ignored by poll when there is no timer
+    pfd[3] = (struct pollfd) {wait_fd, POLLIN, 0}; // likewise when nothing is awaited
+    int count = 4 + capture_poll_fds(pfd + 4);
+    
+    int events = 0;
+    if (poll(pfd, count, -1) < 0) return 0;
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) events |= EVENT_INPUT;
+    if (pfd[1].revents & POLLIN) events |= EVENT_CHILD;
+    if (pfd[2].revents & POLLIN) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) > 0) events |= EVENT_TIMER;
+    }
+    if (pfd[3].revents & POLLIN) events |= EVENT_WAIT;
+    if (count > 4) read_captures(pfd + 4);
+    return events;
+}
+
+// finished children free job slots for the queue, input is read one block at a time
+void handle_events(int events, line_reader* reader, path* head, program_state** p_state) {
+    if (events & EVENT_CHILD) {
+        reap_children();
+        schedule_jobs(head, p_state);
+    }
+    if ((events & EVENT_TIMER) && prompt_pending) show_prompt();
+    if ((events & EVENT_INPUT) && editor.enabled) edit_input(reader, head);
+    else if (events & EVENT_INPUT) fill_reader(reader);
+}
+
+// the prompt timer is only needed when there is a prompt to redraw
+void init_events() {
+    prompt_pending = false;
+    if (interactive) timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+}
+
+void free_events() {
+    if (timer_fd >= 0) close(timer_fd);
+    timer_fd = -1;
+    free(event_fds);
+    event_fds = NULL;
+    event_fds_size = 0;
 }
 
-void run_commands(char** commands, path* head, program_state** p_state) {
-    char whitespace [4] = "\n\t\r ";
+void set_timer(int ms) {
+    struct itimerspec timeout;
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.it_value.tv_sec = ms / 1000;
+    timeout.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timer_fd >= 0) timerfd_settime(timer_fd, 0, &timeout, NULL);
+}
+
+/* collects every child that has exited. Signals coalesce, so one byte in the
+ * pipe can stand for many children; wait4 is repeated until nothing is left */
+void reap_children() {
+    char drain [256];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+    
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        processes* job = find_process(pid);
+        if (job != NULL) finish_job(job, status, &usage);
+    }
+}
+
+void finish_job(processes* job, int status, struct rusage* usage) {
+    job->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    job->process_state = DEAD;
+    char* hit = limit_hit(status, usage, &job->limits);
+    record_job(job->id, job->prc_name, job->exit_status, &job->started, usage, hit);
+    if (job->reports_status && job->exit_status != 0) commands_failed++;
+    if (job->reports_status && job->journal_id != 0) journal_result(job->journal_id, job->exit_status, job->prc_name);
+    if (job->reports_status && job->reply_fd >= 0) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        send_reply(job->reply_fd, job->exit_status, (end.tv_sec - job->started.tv_sec) + (end.tv_nsec - job->started.tv_nsec) / 1e9);
+    }
+    if (job->waiter != NULL) {
+        job->waiter->status = job->exit_status;
+        job->waiter->done = true;
+        last_awaited = job->waiter;
+        jobs_awaited--;
+    }
+    if (interactive) {
+        if (job->exit_status == 0) printf("\nProcess %d finished running.\n", job->id);
+        else if (hit != NULL) printf("\nProcess %d was stopped by its %s limit.\n", job->id, hit);
+        else printf("\nProcess %d finished running with status %d.\n", job->id, job->exit_status);
+        if (!prompt_pending) set_timer(PROMPT_DELAY_MS);
+        prompt_pending = true;
+    }
+    delete_process(job->id);
+}
+
+void manage_state(path* head, program_state** p_state) {
+    //change mode
+    //if signal handler fails clean with wait
+    reap_children(); // report what finished while the line was running
+    schedule_jobs(head, p_state);
+    apply_mode(p_state);
+    show_prompt();
+}
+
+/* in parallel mode commands that would start a process wait in the job queue
+ * when every job slot is taken. Builtins always run straight away. A && or ||
+ * runs or skips its pipeline on the status of the last one that ran, so the
+ * pipeline before it always runs in the foreground */
+void run_commands(parsed_line* line, path* head, program_state** p_state) {
     int i;
-    for (i = 0; commands[i] != NULL; i++) {
-        remove_comments(commands[i]);
-        char** params = tokenify(commands[i], whitespace);
-        execute_command(params, commands[i], head, p_state); 
-		free_tokens(params);
+    for (i = 0; i < line->num_pipelines; i++) {
+        pipeline* command = &line->pipelines[i];
+        if (command->connector == CONNECT_AND && (*p_state)->last_status != 0) continue;
+        if (command->connector == CONNECT_OR && (*p_state)->last_status == 0) continue;
+        current_journal_id = run_journal.fd >= 0 && !reruns_on_resume(command) ? journal_id(command->text) : 0;
+        if (current_journal_id != 0 && journal_done(current_journal_id)) {
+            (*p_state)->last_status = 0;
+            run_journal.skipped++;
+            continue;
+        }
+        if (command->deferred && (command = expand_pipeline(command, p_state)) == NULL) continue;
+        if (i + 1 < line->num_pipelines && line->pipelines[i + 1].connector != CONNECT_ALWAYS) {
+            int mode = (*p_state)->mode;
+            (*p_state)->mode = SEQUENTIAL;
+            run_command(command, head, p_state);
+            (*p_state)->mode = mode;
+            continue;
+        }
+        if ((*p_state)->mode == PARALLEL && !is_builtin_pipeline(command) && !job_slot_free(p_state)) {
+            enqueue_job(command, current_journal_id);
+            continue;
+        }
+        run_command(command, head, p_state);
 	}
+	current_journal_id = 0;
 	return;
 }
 
-/* executes $PATH commands using execv. "builtin" commands are either handled explicity
- * or sent to the system.*/
-void execute_command(char** params, char* command, path* head, program_state** p_state) {
-    if (params[0] == NULL) return;
-    if (is_built_in_command(params[0])) { //handle builtin commands
-		run_builtin(params, command, p_state);
+/* parses a deferred pipeline again now that the ones before it have run,
+ * this time with its variables replaced and its patterns globbed. NULL when there is nothing to run */
+pipeline* expand_pipeline(pipeline* command, program_state** p_state) {
+    parsed_line* line = parse_line(&line_arena, command->text, true);
+    if (line == NULL) {
+        (*p_state)->last_status = 2;
+        commands_run++;
+        commands_failed++;
+        if (reply_fd >= 0) send_reply(reply_fd, 2, 0);
+        return NULL;
+    }
+    if (line->num_pipelines == 0) (*p_state)->last_status = 0; // only unset variables
+    return line->num_pipelines > 0 ? &line->pipelines[0] : NULL;
+}
+
+/* overhead is the shell's own time for a command: everything done here
+ * except waiting for a foreground command to finish */
+void run_command(pipeline* command, path* head, program_state** p_state) {
+    uint64_t start = now_ns(), waited = foreground_wait_ns;
+    if (command->num_stages > 1) execute_pipeline(command, head, p_state);
+    else execute_command(command->stages[0].argv, &command->stages[0].io, command->text, head, p_state);
+    record_phase_ns(PHASE_OVERHEAD, now_ns() - start - (foreground_wait_ns - waited));
+    // parallel jobs are journaled by finish_job
+    if (current_journal_id != 0 && ((*p_state)->mode == SEQUENTIAL || is_builtin_pipeline(command))) journal_result(current_journal_id, (*p_state)->last_status, command->text);
+    // and reply to the client then too, unless the job never started
+    bool finished = (*p_state)->mode == SEQUENTIAL || is_builtin_pipeline(command) || (*p_state)->last_status != 0;
+    if (reply_fd >= 0 && finished) send_reply(reply_fd, (*p_state)->last_status, (now_ns() - start) / 1e9);
+    
+	// jobs started in parallel report their failures when they are reaped
+	commands_run++;
+	if ((*p_state)->last_status != 0) commands_failed++;
+}
+
+// true for commands that run inside the shell, pipelines always fork
+bool is_builtin_pipeline(pipeline* command) {
+    char* name = command->stages[0].argv[0];
+    if (limited_command(command->stages[0].argv) > 0) return false; // limit with a command starts a process
+    return command->num_stages == 1 && (runs_builtin(command->stages[0].argv) || is_assignment(name));
+}
+
+/* executes $PATH commands using execv. "builtin" commands are run inside the shell.
+ * io may be NULL when nothing is redirected. Returns the command's exit status,
+ * which is 0 for jobs started in parallel mode */
+int execute_command(char** params, redirect* io, char* command, path* head, program_state** p_state) {
+    if (params[0] == NULL) return (*p_state)->last_status;
+    job_limits limits = (*p_state)->limits;
+    params = strip_limits(params, &limits);
+    if (params == NULL) return (*p_state)->last_status = 1;
+    if (is_assignment(params[0])) { // NAME=value, which only sets the variable
+        int i, status = 0;
+        for (i = 0; params[i] != NULL; i++) {
+            if (is_assignment(params[i])) assign_variable(params[i], false, head);
+            else {
+                printf("Setting variables for one command is not supported, use export: %s.\n", params[i]);
+                status = 1;
+                break;
+            }
+        }
+        return (*p_state)->last_status = status;
+    }
+    if (runs_builtin(params)) { //handle builtin commands
+		(*p_state)->last_status = run_redirected_builtin(params, io, head, p_state);
 	} else {
+        uint64_t start = now_ns();
         char* curr_command = is_valid_command(params[0], head); // checks if valid, attaches path to code
+        record_phase(PHASE_LOOKUP, start);
         if (curr_command == NULL) {
             printf("Invalid command: %s\n", params[0]);
-            return;
+            return (*p_state)->last_status = 127;
+        }
+        char* name = params[0]; // params live in the line arena, swap the full path in for exec
+        params[0] = curr_command;
+        int exec_errno = 0;
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        bool captured = (*p_state)->mode == PARALLEL && output_mode != OUTPUT_DIRECT && start_capture(fds);
+        int io_fds[3] = {fds[0], fds[1], fds[2]}; // files replace the capture where they are given
+        pid_t pid = -1;
+        bool opened = open_redirects(io, io_fds);
+        if (opened) {
+            pid = launch_process(params, io_fds, &limits, &exec_errno);
+            close_redirects(io, io_fds);
         }
-        params[0] = realloc(params[0], (strlen(curr_command) + 1) * sizeof(char));
-        strcpy(params[0], curr_command);
-        free(curr_command);
-        shell_printed = false;
-        pid_t pid = fork();
-		if (pid == 0) {
-            execv(params[0], params);
-            if ((*p_state)->mode == PARALLEL)
-                delete_process_by_name(command); // delete from list by name since there is not pid associated with the process
-            printf("Command %s failed to run.\n", params[0]); 
-            (*p_state)->do_exit = true;
-		} else if (pid < 0) printf("Failed to start process.\n");
-		else {
-		    if ((*p_state)->mode == SEQUENTIAL) waitpid(0, NULL, 0);
-    		else {
-    		    shell_printed = false; //making sure that the program knows that the shell has not been printed
-    		    add_process(pid, command);
+        if (captured) end_capture_setup(fds);
+		if (!opened) {
+		    (*p_state)->last_status = 1;
+		} else if (pid < 0 && exec_errno != 0) {
+		    printf("Command %s failed to run: %s.\n", params[0], strerror(exec_errno));
+		    (*p_state)->last_status = exec_errno == ENOENT ? 127 : 126;
+		} else if (pid < 0) {
+		    printf("Failed to start process.\n");
+		    (*p_state)->last_status = 1;
+		} else {
+		    if ((*p_state)->mode == SEQUENTIAL) {
+		        int status = 0;
+		        struct rusage usage;
+		        uint64_t wait_start = now_ns();
+		        pid_t waited = wait4(pid, &status, 0, &usage);
+		        foreground_wait_ns += now_ns() - wait_start;
+		        if (waited == pid) {
+		            (*p_state)->last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		            char* hit = limit_hit(status, &usage, &limits);
+		            record_job(pid, command, (*p_state)->last_status, &started, &usage, hit);
+		            if (hit != NULL) printf("%s was stopped by its %s limit.\n", name, hit);
+		        }
+		    } else {
+    		    (*p_state)->last_status = 0;
+    		    processes* job = add_process(pid, command);
+    		    job->reports_status = true;
+    		    job->limits = limits;
+    		    place_job(pid, p_state);
     		}	
 		}
+		params[0] = name;
+		free(curr_command);
     }
+    return (*p_state)->last_status;
+}
+
+/* runs a | separated command with every stage started at once. Each stage
+ * reads from the previous one through a pipe; builtins get a forked copy of
+ * the shell so they can write into the pipeline too. The pipeline's status is
+ * the status of its last stage */
+int execute_pipeline(pipeline* command, path* head, program_state** p_state) {
+    int num_stages = command->num_stages;
+    int i;
+    
+    // resolve everything first so a typo does not leave half a pipeline running
+    char*** params = calloc(num_stages, sizeof(char**));
+    char** names = calloc(num_stages, sizeof(char*));
+    pid_t* pids = calloc(num_stages, sizeof(pid_t));
+    job_limits* limits = calloc(num_stages, sizeof(job_limits));
+    bool valid = true;
+    for (i = 0; i < num_stages; i++) {
+        limits[i] = (*p_state)->limits;
+        params[i] = strip_limits(command->stages[i].argv, &limits[i]);
+        if (params[i] == NULL) {
+            params[i] = command->stages[i].argv; // names[i] stays NULL, nothing to restore
+            valid = false;
+            continue;
+        }
+        if (!runs_builtin(params[i])) {
+            uint64_t start = now_ns();
+            char* curr_command = is_valid_command(params[i][0], head);
+            record_phase(PHASE_LOOKUP, start);
+            if (curr_command == NULL) {
+                printf("Invalid command: %s\n", params[i][0]);
+                valid = false;
+                continue;
+            }
+            names[i] = params[i][0];
+            params[i][0] = curr_command;
+        }
+    }
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    // a captured pipeline shares one capture: the last stage's stdout and every stage's stderr
+    int output[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    bool captured = valid && (*p_state)->mode == PARALLEL && output_mode != OUTPUT_DIRECT && start_capture(output);
+    int in_fd = STDIN_FILENO;
+    for (i = 0; valid && i < num_stages; i++) {
+        int pipefd[2] = {-1, -1};
+        if (i < num_stages - 1 && make_pipe(pipefd) < 0) {
+            printf("Failed to create pipe: %s.\n", strerror(errno));
+            break;
+        }
+        int fds[3] = {in_fd, i < num_stages - 1 ? pipefd[1] : output[1], output[2]};
+        int exec_errno = 0;
+        
+        redirect* io = &command->stages[i].io;
+        bool opened = open_redirects(io, fds);
+        if (!opened) pids[i] = 0; // reported already, the other stages still run
+        else if (runs_builtin(params[i])) pids[i] = fork_builtin(params[i], fds, head, p_state);
+        else pids[i] = launch_process(params[i], fds, &limits[i], &exec_errno);
+        if (pids[i] < 0 && exec_errno != 0) printf("Command %s failed to run: %s.\n", params[i][0], strerror(exec_errno));
+        else if (pids[i] < 0) printf("Failed to start process.\n");
+        if (opened) close_redirects(io, fds);
+        
+        // the children hold their own copies of the pipe ends now
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        if (pipefd[1] >= 0) close(pipefd[1]);
+        in_fd = pipefd[0];
+    }
+    if (in_fd != STDIN_FILENO && in_fd >= 0) close(in_fd);
+    if (captured) end_capture_setup(output);
+    
+    int status = 127; // unless the last stage runs
+    struct rusage total; // the pipeline is accounted as one command
+    memset(&total, 0, sizeof(total));
+    pid_t waited = 0;
+    char* hit = NULL;
+    for (i = 0; i < num_stages; i++) {
+        if (pids[i] <= 0) continue;
+        if ((*p_state)->mode == PARALLEL) {
+            processes* job = add_process(pids[i], command->text);
+            job->reports_status = i == num_stages - 1;
+            job->limits = limits[i];
+            place_job(pids[i], p_state);
+            if (i == num_stages - 1) status = 0;
+            continue;
+        }
+        int stage_status = 0;
+        struct rusage usage;
+        uint64_t wait_start = now_ns();
+        pid_t stage = wait4(pids[i], &stage_status, 0, &usage);
+        foreground_wait_ns += now_ns() - wait_start;
+        if (stage != pids[i]) continue;
+        add_usage(&total, &usage);
+        waited = pids[i];
+        if (hit == NULL) hit = limit_hit(stage_status, &usage, &limits[i]);
+        if (i == num_stages - 1) status = WIFEXITED(stage_status) ? WEXITSTATUS(stage_status) : 128 + WTERMSIG(stage_status);
+    }
+    if (waited > 0) record_job(waited, command->text, status, &started, &total, hit);
+    if (hit != NULL) printf("%s was stopped by its %s limit.\n", command->text, hit);
+    
+    for (i = 0; i < num_stages; i++) {
+        if (names[i] == NULL) continue;
+        free(params[i][0]);
+        params[i][0] = names[i];
+    }
+    free(params);
+    free(names);
+    free(pids);
+    free(limits);
+    return (*p_state)->last_status = status;
+}
+
+/* starts params[0] with the selected backend. fds holds the descriptors to use
+ * as the child's stdin, stdout and stderr, or NULL to share the shell's.
+ * limits, when not NULL, are applied before exec; they need the fork backend.
+ * Returns the child's pid, or -1 with exec_errno set when the program could
+ * not be executed (0 if the process itself could not be created). Failed
+ * children never reach the job list. SIGCHLD is held off until a failed child
+ * has been collected here so the signal handler never reports it as a
+ * finished job */
+pid_t launch_process(char** params, int* fds, job_limits* limits, int* exec_errno) {
+    uint64_t start = now_ns();
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old_mask);
+    
+    pid_t pid;
+    *exec_errno = 0;
+    if (spawn_backend == SPAWN_FORK || (limits != NULL && limits_active(limits))) {
+        pid = fork_process(params, fds, limits, exec_errno, &old_mask);
+    }
+    else pid = spawn_process(params, fds, exec_errno, &old_mask);
+    
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    record_phase(PHASE_SPAWN, start);
+    return pid;
+}
+
+/* classic fork + exec. A close-on-exec pipe carries the child's errno back when
+ * exec, or applying its limits, fails; a successful exec closes it so the
+ * parent reads end of file */
+pid_t fork_process(char** params, int* fds, job_limits* limits, int* exec_errno, sigset_t* child_mask) {
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) < 0) return -1;
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(err_pipe[0]);
+        sigprocmask(SIG_SETMASK, child_mask, NULL);
+        redirect_stdio(fds);
+        int err = limits != NULL ? apply_limits(limits) : 0;
+        if (err == 0) {
+            execve(params[0], params, exec_environment());
+            err = errno;
+        }
+        write(err_pipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+    close(err_pipe[1]);
+    if (pid < 0) {
+        close(err_pipe[0]);
+        return -1;
+    }
+    
+    int err = 0;
+    ssize_t n;
+    do {
+        n = read(err_pipe[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    close(err_pipe[0]);
+    
+    if (n == sizeof(err)) {
+        waitpid(pid, NULL, 0); // the child has already given up, collect it
+        *exec_errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/* posix_spawn blocks until the child has exec'd so exec failures come back as the return value */
+pid_t spawn_process(char** params, int* fds, int* exec_errno, sigset_t* child_mask) {
+    pid_t pid;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, child_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawn_file_actions_init(&actions);
+    int order [3], i;
+    if (fds != NULL) stdio_order(fds, order);
+    for (i = 0; fds != NULL && i < 3; i++) {
+        if (fds[order[i]] != order[i]) posix_spawn_file_actions_adddup2(&actions, fds[order[i]], order[i]);
+    }
+    int err = posix_spawn(&pid, params[0], &actions, &attr, params, exec_environment());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        *exec_errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/* builtins have no program to exec, so a pipeline stage that is a builtin runs
+ * in a forked copy of the shell and exits with the builtin's status */
+pid_t fork_builtin(char** params, int* fds, path* head, program_state** p_state) {
+    fflush(stdout); // or the child would print our buffered output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        redirect_stdio(fds);
+        int status = run_builtin(params, head, p_state);
+        fflush(stdout);
+        _exit(status);
+    }
+    return pid;
+}
+
+// moves the given descriptors onto stdin, stdout and stderr in a child
+void redirect_stdio(int* fds) {
+    int order [3], i;
+    if (fds != NULL) stdio_order(fds, order);
+    for (i = 0; fds != NULL && i < 3; i++) {
+        if (fds[order[i]] != order[i]) dup2(fds[order[i]], order[i]);
+    }
+}
+
+/* the order to put fds on 0, 1 and 2 in: copies of the shell's own
+ * descriptors first, as in 2>&1 > file, before the one they copy is replaced */
+void stdio_order(int* fds, int* order) {
+    int i, n = 0;
+    for (i = 0; i < 3; i++) {
+        if (fds[i] <= STDERR_FILENO) order[n++] = i;
+    }
+    for (i = 0; i < 3; i++) {
+        if (fds[i] > STDERR_FILENO) order[n++] = i;
+    }
+}
+
+/* opens the stage's redirections in place of the descriptors it would
+ * otherwise get. The files are close-on-exec; the child only keeps the copies
+ * dup2 puts on 0, 1 and 2. Prints a message on failure, and then has opened
+ * nothing and left fds as they were, so there is nothing to close */
+bool open_redirects(redirect* io, int* fds) {
+    int opened [3];
+    int i;
+    for (i = 0; io != NULL && i < 3; i++) {
+        opened[i] = fds[i];
+        if (io->files[i] == NULL) continue;
+        int flags = i == 0 ? O_RDONLY : O_WRONLY | O_CREAT | (io->append[i] ? O_APPEND : O_TRUNC);
+        opened[i] = open(io->files[i], flags | O_CLOEXEC, 0666);
+        if (opened[i] < 0) {
+            printf("Failed to open %s: %s.\n", io->files[i], strerror(errno));
+            for (i--; i >= 0; i--) {
+                if (io->files[i] != NULL) close(opened[i]);
+            }
+            return false;
+        }
+    }
+    for (i = 0; io != NULL && i < 3; i++) {
+        if (io->copies[i] >= 0) opened[i] = io->copies_original[i] ? fds[(int) io->copies[i]] : opened[(int) io->copies[i]];
+    }
+    for (i = 0; io != NULL && i < 3; i++) fds[i] = opened[i];
+    return true;
+}
+
+bool redirected(redirect* io, int fd) {
+    return io != NULL && (io->files[fd] != NULL || io->copies[fd] >= 0);
+}
+
+// the child has its copies, closes what open_redirects opened
+void close_redirects(redirect* io, int* fds) {
+    int i;
+    for (i = 0; io != NULL && i < 3; i++) {
+        if (io->files[i] != NULL && fds[i] > STDERR_FILENO) close(fds[i]);
+    }
+}
+
+bool set_spawn_backend(char* name) {
+    if (strcmp(name, "fork") == 0) spawn_backend = SPAWN_FORK;
+    else if (strcmp(name, "spawn") == 0) spawn_backend = SPAWN_POSIX;
+    else return false;
+    return true;
 }
 
 void show_prompt() {
+    if (!interactive) return;
+    uint64_t start = now_ns();
+    prompt_pending = false;
     char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL)
-    	printf("%s> ", cwd);
-    else
-	    perror("getcwd() error");
+    if (getcwd(cwd, sizeof(cwd)) == NULL) perror("getcwd() error");
+    else if (editor.enabled) {
+        char prompt [sizeof(editor.prompt)];
+        snprintf(prompt, sizeof(prompt), "%s> ", cwd);
+        edit_prompt(prompt);
+    } else printf("%s> ", cwd);
 	fflush(stdout);
-	
+	record_phase(PHASE_PROMPT, start);
 }
 
 //splits a string by a delimiter
@@ -283,455 +1947,3830 @@ char** tokenify(char* buffer, char* split) {
 	return final_tok;
 }
 
-char** splitCommands(char* buffer) {
-    return tokenify(buffer, ";");
+void init_reader(line_reader* reader, int fd) {
+    memset(reader, 0, sizeof(line_reader));
+    reader->fd = fd;
+    reader->size = READ_BLOCK_SIZE;
+    reader->buffer = malloc(reader->size);
+    reader->comment = NO_COMMENT;
 }
 
-char* is_valid_command(char* command, path* head) {
-    path* temp = head;
+// reads lines out of memory that is already loaded, the data is never written to
+void wrap_reader(line_reader* reader, char* data, size_t len) {
+    memset(reader, 0, sizeof(line_reader));
+    reader->fd = -1;
+    reader->buffer = data;
+    reader->size = len;
+    reader->end = len;
+    reader->comment = NO_COMMENT;
+    reader->eof = true;
+}
+
+void free_reader(line_reader* reader) {
+    if (reader->fd >= 0) free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+/* returns the next line with its newline and comment cut off, or NULL at the
+ * end of the input. The line stays valid until the next call */
+char* read_line(line_reader* reader) {
+    size_t start, len;
+    while (!next_line(reader, &start, &len)) {
+        if (!fill_reader(reader)) return NULL;
+    }
+    reader->buffer[start + len] = '\0';
+    return reader->buffer + start;
+}
+
+/* finds the bounds of the next complete line in what has been read, without
+ * reading more. The last line of the input does not need a newline */
+bool next_line(line_reader* reader, size_t* start, size_t* len) {
+    if (!scan_line(reader) && (!reader->eof || reader->scanned == reader->start)) return false;
+    *start = reader->start;
+    *len = (reader->comment != NO_COMMENT ? reader->comment : reader->scanned) - reader->start;
     
-    while (temp != NULL) {        
-	    struct stat statresult;
-	    // add string to each path
-        char comm[1024]= "";
-        int stat_res = 0;    
-        strcat(comm, temp->path_var);
-        strcat(comm, "/");
-        strcat(comm, command);
-        stat_res = stat(comm, &statresult);
-        if (stat_res == 0) {
-            char* ret = calloc(strlen(comm) + 1, sizeof(char));
-            strcpy(ret, comm);
-            return ret;
-        }        		        
-        temp = temp->next;
+    reader->start = reader->scanned < reader->end ? reader->scanned + 1 : reader->end;
+    reader->scanned = reader->start;
+    reader->quote = '\0';
+    reader->escaped = false;
+    reader->comment = NO_COMMENT;
+    return true;
+}
+
+/* carries on scanning the current line from where the last scan stopped.
+ * Quotes and backslashes hide a # the same way the parser treats them, and
+ * once a comment has started only the newline is looked for */
+bool scan_line(line_reader* reader) {
+    char* buffer = reader->buffer;
+    size_t i;
+    for (i = reader->scanned; i < reader->end; i++) {
+        if (reader->comment != NO_COMMENT) {
+            char* newline = memchr(buffer + i, '\n', reader->end - i);
+            i = newline != NULL ? (size_t) (newline - buffer) : reader->end;
+            break;
+        }
+        char c = buffer[i];
+        if (c == '\n') break;
+        if (reader->escaped) reader->escaped = false;
+        else if (c == '\\' && reader->quote != '\'') reader->escaped = true;
+        else if (reader->quote != '\0') {
+            if (c == reader->quote) reader->quote = '\0';
+        }
+        else if (c == '\'' || c == '"') reader->quote = c;
+        else if (c == '#') reader->comment = i;
     }
-    return NULL;
+    reader->scanned = i;
+    return i < reader->end;
 }
 
-void remove_comments(char* buffer) {
-    int i;
-    for (i=0; i<strlen(buffer); i++){
-        if (buffer[i] == '#' || buffer[i] == '\n') {
-			buffer[i] = '\0';
-			return;
-		}
-	}
+/* reads another block. The unfinished line is moved to the front of the
+ * buffer first, and the buffer doubles when that line already fills it.
+ * One byte is always left free for the terminating NUL */
+bool fill_reader(line_reader* reader) {
+    if (reader->eof) return false;
+    compact_reader(reader, 1);
+    
+    ssize_t count;
+    do {
+        count = read(reader->fd, reader->buffer + reader->end, reader->size - reader->end - 1);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) reader->eof = true;
+    else reader->end += count;
+    return true;
 }
 
-//free arrays of arrays
-void free_tokens(char** tokens) {
-    int j;
-    for (j = 0; tokens[j] != NULL; j++) {
-	    free(tokens[j]);
+// true when a line can be returned without blocking
+bool line_ready(line_reader* reader) {
+    return scan_line(reader) || (reader->eof && reader->scanned > reader->start);
+}
+
+// moves the unread data to the front and makes room for more than room bytes
+void compact_reader(line_reader* reader, size_t room) {
+    if (reader->start > 0) {
+        size_t shift = reader->start;
+        memmove(reader->buffer, reader->buffer + shift, reader->end - shift);
+        reader->end -= shift;
+        reader->scanned -= shift;
+        if (reader->comment != NO_COMMENT) reader->comment -= shift;
+        reader->start = 0;
     }
-    free(tokens);
-}	
+    while (reader->end + room >= reader->size) {
+        reader->size *= 2;
+        reader->buffer = realloc(reader->buffer, reader->size);
+    }
+}
 
-//find previous directory
-char* previous_directory(char* dir) {
-    char* prev = calloc(strlen(dir), sizeof(char));
-    int i;
+// adds data as if it had been read, for lines from the editor
+void feed_reader(line_reader* reader, char* data, size_t len) {
+    compact_reader(reader, len);
+    memcpy(reader->buffer + reader->end, data, len);
+    reader->end += len;
+}
+
+/*>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Line editor <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<*/
+void init_editor() {
+    memset(&editor, 0, sizeof(editor));
+    editor.browsing = -1;
+    editor.enabled = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &editor.cooked) == 0;
+    editor.size = 256;
+    editor.line = malloc(editor.size);
+}
+
+void free_editor() {
+    if (editor.active) raw_mode(false);
+    free(editor.line);
+    free(editor.draft);
+    memset(&editor, 0, sizeof(editor));
+}
+
+/* raw mode hands over every byte as it is typed, ^C and ^D included. Output
+ * processing stays on so job messages still end their lines properly */
+void raw_mode(bool on) {
+    struct termios raw = editor.cooked;
+    if (on) {
+        raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON);
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+/* shows the prompt. A line already being edited is drawn again under it, as
+ * after a job has reported that it finished */
+void edit_prompt(char* prompt) {
+    snprintf(editor.prompt, sizeof(editor.prompt), "%s", prompt);
+    if (!editor.active) {
+        fflush(stdout);
+        raw_mode(true);
+        editor.active = true;
+        editor.len = editor.cursor = 0;
+        editor.line[0] = '\0';
+        editor.browsing = -1;
+    }
+    refresh_line();
+}
+
+/* reads what was typed, ends the input on ^D at an empty line. What follows
+ * an Enter in the same read is kept and goes to the next line's editor */
+void edit_input(line_reader* reader, path* head) {
+    if (!editor.active) edit_prompt("> "); // the rest of a line with an open quote
+    char input [sizeof(editor.pending)];
+    ssize_t count;
+    if (editor.pending_len > 0) {
+        memcpy(input, editor.pending, editor.pending_len);
+        count = editor.pending_len;
+        editor.pending_len = 0;
+    } else do {
+        count = read(STDIN_FILENO, input, sizeof(input));
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        raw_mode(false);
+        editor.active = false;
+        reader->eof = true;
+        return;
+    }
+    ssize_t i;
+    for (i = 0; i < count && editor.active; i++) {
+        if (editor.escape_len > 0 && edit_escape(input[i])) continue;
+        edit_key(input[i], reader, head);
+    }
+    if (i < count && !reader->eof) {
+        memcpy(editor.pending, input + i, count - i);
+        editor.pending_len = count - i;
+    }
+}
+
+/* collects an escape sequence for the arrow, home, end and delete keys.
+ * Returns false when c does not belong to one and is a key of its own */
+bool edit_escape(char c) {
+    if (editor.escape_len == 1 && c != '[' && c != 'O') {
+        editor.escape_len = 0;
+        return false;
+    }
+    editor.escape[editor.escape_len++] = c;
+    if (editor.escape_len == 2 || (isdigit((unsigned char) c) && editor.escape_len < (int) sizeof(editor.escape) - 1)) return true;
+    editor.escape[editor.escape_len] = '\0';
+    editor.escape_len = 0;
     
-    //search from the back for first slash
-    for (i = strlen(dir) - 1; i >= 0; i--) {
-        if(dir[i] == '/') {
-            strncpy(prev, dir, i);
-            prev[i] = '\0';
+    char* key = editor.escape + 1;
+    if (strcmp(key, "[A") == 0) browse_history(-1);
+    else if (strcmp(key, "[B") == 0) browse_history(1);
+    else if (strcmp(key, "[C") == 0) editor.cursor = next_char(editor.cursor);
+    else if (strcmp(key, "[D") == 0) editor.cursor = previous_char(editor.cursor);
+    else if (strcmp(key, "[H") == 0 || strcmp(key, "OH") == 0 || strcmp(key, "[1~") == 0 || strcmp(key, "[7~") == 0) editor.cursor = 0;
+    else if (strcmp(key, "[F") == 0 || strcmp(key, "OF") == 0 || strcmp(key, "[4~") == 0 || strcmp(key, "[8~") == 0) editor.cursor = editor.len;
+    else if (strcmp(key, "[3~") == 0) delete_text(editor.cursor, next_char(editor.cursor));
+    refresh_line();
+    return true;
+}
+
+/* the emacs style keys most line editors share */
+void edit_key(char c, line_reader* reader, path* head) {
+    size_t word;
+    switch (c) {
+        case 27: // escape, the rest of the sequence follows
+            editor.escape[0] = c;
+            editor.escape_len = 1;
+            return;
+        case '\r':
+        case '\n':
+            finish_edit(reader);
+            return;
+        case 1: // ^A
+            editor.cursor = 0;
+            break;
+        case 2: // ^B
+            editor.cursor = previous_char(editor.cursor);
+            break;
+        case 3: // ^C drops the line
+            write_terminal("^C\r\n", 4);
+            editor.len = editor.cursor = 0;
+            editor.line[0] = '\0';
+            editor.browsing = -1;
+            break;
+        case 4: // ^D
+            if (editor.len == 0) {
+                write_terminal("\r\n", 2);
+                raw_mode(false);
+                editor.active = false;
+                reader->eof = true;
+                return;
+            }
+            delete_text(editor.cursor, next_char(editor.cursor));
+            break;
+        case 5: // ^E
+            editor.cursor = editor.len;
+            break;
+        case 6: // ^F
+            editor.cursor = next_char(editor.cursor);
+            break;
+        case '\t':
+            complete_word(head);
+            break;
+        case 11: // ^K
+            delete_text(editor.cursor, editor.len);
+            break;
+        case 12: // ^L
+            write_terminal("\033[H\033[2J", 7);
+            break;
+        case 14: // ^N
+            browse_history(1);
+            break;
+        case 16: // ^P
+            browse_history(-1);
+            break;
+        case 21: // ^U
+            delete_text(0, editor.cursor);
+            break;
+        case 23: // ^W deletes the word before the cursor
+            word = editor.cursor;
+            while (word > 0 && editor.line[word - 1] == ' ') word--;
+            while (word > 0 && editor.line[word - 1] != ' ') word--;
+            delete_text(word, editor.cursor);
+            break;
+        case 8:
+        case 127:
+            delete_text(previous_char(editor.cursor), editor.cursor);
+            break;
+        default:
+            if ((unsigned char) c < 32) return; // other control keys do nothing
+            insert_text(&c, 1);
             break;
-        }
     }
-    return prev;
+    refresh_line();
 }
 
-void change_directory(char* dir) {
-    if (dir == NULL) {
-        chdir("/home/chav"); //go to root directory
+// the line goes to the reader and the terminal back to normal for the command
+void finish_edit(line_reader* reader) {
+    editor.cursor = editor.len;
+    refresh_line();
+    write_terminal("\r\n", 2);
+    raw_mode(false);
+    editor.active = false;
+    feed_reader(reader, editor.line, editor.len);
+    feed_reader(reader, "\n", 1);
+}
+
+/* draws the prompt and line over the current terminal line and puts the
+ * cursor back in place. UTF-8 continuation bytes take no column */
+void refresh_line() {
+    size_t prompt_len = strlen(editor.prompt);
+    char* out = malloc(prompt_len + editor.len + 32);
+    size_t len = 0, after = 0, i;
+    out[len++] = '\r';
+    memcpy(out + len, editor.prompt, prompt_len);
+    len += prompt_len;
+    memcpy(out + len, editor.line, editor.len);
+    len += editor.len;
+    len += sprintf(out + len, "\033[K");
+    for (i = editor.cursor; i < editor.len; i++) {
+        if ((editor.line[i] & 0xC0) != 0x80) after++;
+    }
+    if (after > 0) len += sprintf(out + len, "\033[%zuD", after);
+    write_terminal(out, len);
+    free(out);
+}
+
+void write_terminal(char* text, size_t len) {
+    fflush(stdout); // anything printed first comes first
+    write_all(STDOUT_FILENO, text, len);
+}
+
+void insert_text(char* text, size_t len) {
+    if (editor.len + len + 1 > editor.size) {
+        while (editor.len + len + 1 > editor.size) editor.size *= 2;
+        editor.line = realloc(editor.line, editor.size);
+    }
+    memmove(editor.line + editor.cursor + len, editor.line + editor.cursor, editor.len - editor.cursor + 1);
+    memcpy(editor.line + editor.cursor, text, len);
+    editor.len += len;
+    editor.cursor += len;
+}
+
+// removes [from, to) and leaves the cursor at from
+void delete_text(size_t from, size_t to) {
+    if (to <= from) return;
+    memmove(editor.line + from, editor.line + to, editor.len - to + 1);
+    editor.len -= to - from;
+    editor.cursor = from;
+}
+
+// the cursor moves over whole UTF-8 characters
+size_t previous_char(size_t pos) {
+    if (pos > 0) pos--;
+    while (pos > 0 && (editor.line[pos] & 0xC0) == 0x80) pos--;
+    return pos;
+}
+
+size_t next_char(size_t pos) {
+    if (pos < editor.len) pos++;
+    while (pos < editor.len && (editor.line[pos] & 0xC0) == 0x80) pos++;
+    return pos;
+}
+
+/* steps through the history, -1 for older. Going past the newest entry brings
+ * back the line that was being typed */
+void browse_history(int direction) {
+    long count = shell_history.count;
+    long next = editor.browsing < 0 ? (direction < 0 ? count - 1 : -1) : editor.browsing + direction;
+    if (editor.browsing < 0 && next < 0) return;
+    if (next < 0) return; // already at the oldest
+    if (editor.browsing < 0) {
+        free(editor.draft);
+        editor.draft = strndup(editor.line, editor.len);
+    }
+    editor.len = editor.cursor = 0;
+    editor.line[0] = '\0';
+    if (next >= count) {
+        editor.browsing = -1;
+        insert_text(editor.draft, strlen(editor.draft));
         return;
     }
+    editor.browsing = next;
+    history_entry* entry = history_at(next);
+    insert_text(history_text(entry), entry->len);
+}
+
+/* completes the word before the cursor: a command name in command position,
+ * otherwise a file name. Only one candidate fills in the whole word; several
+ * fill in what they share, and are listed when that adds nothing */
+void complete_word(path* head) {
+    size_t start = editor.cursor;
+    while (start > 0 && (editor.line[start - 1] != ' ' || (start > 1 && editor.line[start - 2] == '\\'))
+           && strchr(";|&<>", editor.line[start - 1]) == NULL) start--;
+    size_t before = start;
+    while (before > 0 && editor.line[before - 1] == ' ') before--;
+    bool command = before == 0 || strchr(";|&", editor.line[before - 1]) != NULL;
     
-    char cwd[1024];
-   	if (getcwd(cwd, sizeof(cwd)) == NULL)
-       perror("getcwd() error");
+    // typed escapes are matched as the characters they stand for
+    char* word = malloc(editor.cursor - start + 1);
+    size_t i, len = 0;
+    for (i = start; i < editor.cursor; i++) {
+        if (editor.line[i] == '\\' && i + 1 < editor.cursor) i++;
+        word[len++] = editor.line[i];
+    }
+    word[len] = '\0';
     
-    if (strcmp(dir, ".") == 0) {
-        //current directory
-        return;
-    } else if (strcmp(dir, "..") == 0)  { //go to previous directory
-        char* prev_dir = previous_directory(cwd);
-        chdir(prev_dir);
-        free(prev_dir);
-        return;
-    } else if ((strstr("/", dir) != NULL)) { //if the string contains no slashes assume it is the cwd
-        char * new_str ;
-        int i;
-        for (i = 0; cwd[i] != '\0'; i++);
+    completions c;
+    memset(&c, 0, sizeof(c));
+    if (command && strchr(word, '/') == NULL) complete_command(word, head, &c);
+    else complete_file(word, &c);
+    
+    if (c.count == 0) write_terminal("\a", 1);
+    else if (c.count == 1 || strlen(c.common) > len) {
+        delete_text(start, editor.cursor);
+        char* name;
+        for (name = c.common; *name != '\0'; name++) {
+            if (strchr(" \t'\"\\;|&<>*?[]$#", *name) != NULL) insert_text("\\", 1);
+            insert_text(name, 1);
+        }
+        size_t common_len = strlen(c.common);
+        if (c.count == 1 && (common_len == 0 || c.common[common_len - 1] != '/')) insert_text(" ", 1);
+    } else list_completions(&c);
+    free(word);
+    free_completions(&c);
+}
 
-        cwd[i] = '/';
-        cwd[i + 1] = '\0';
-     
-        //concatenate string to directory
-        if((new_str = calloc(strlen(cwd)+strlen(dir)+1, sizeof(char*))) != NULL){
-            new_str[0] = '\0';   // ensures the memory is an empty string
-            strcat(new_str,cwd);
-            strcat(new_str,dir);
-            chdir(new_str);
-            free(new_str);
-            return;
+// in columns under the line, which is then drawn again
+void list_completions(completions* c) {
+    struct winsize size;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    int i, longest = 0;
+    for (i = 0; i < c->num_names && i < COMPLETION_LIST_MAX; i++) {
+        char* slash = strrchr(c->names[i], '/');
+        char* name = slash != NULL && slash[1] != '\0' ? slash + 1 : c->names[i];
+        if ((int) strlen(name) > longest) longest = strlen(name);
+    }
+    int columns = width / (longest + 2) > 0 ? width / (longest + 2) : 1;
+    printf("\n");
+    for (i = 0; i < c->num_names && i < COMPLETION_LIST_MAX; i++) {
+        char* slash = strrchr(c->names[i], '/');
+        // a directory is shown with its slash, a file in one without the directory
+        if (slash != NULL && slash[1] == '\0') {
+            char* start = slash;
+            while (start > c->names[i] && start[-1] != '/') start--;
+            printf("%-*s", longest + 2, start);
+        } else printf("%-*s", longest + 2, slash != NULL ? slash + 1 : c->names[i]);
+        if ((i + 1) % columns == 0) printf("\n");
+    }
+    if (i % columns != 0) printf("\n");
+    if (c->count > i) printf("... and %d more\n", c->count - i);
+    fflush(stdout);
+}
+
+/* splits a line into pipelines and words in one pass. Quotes and backslashes
+ * are removed as the words are copied into the arena: single quotes keep
+ * everything literally, double quotes allow \\ \" and \$ escapes, and a
+ * backslash outside quotes escapes any character. $NAME and ${NAME} are
+ * replaced by the variable's value outside single quotes; the value is not
+ * split into words or globbed. Without expand they are left in place and the
+ * pipeline is marked deferred, since one before it on the line may set the
+ * variable; run_commands parses its text again once it is reached. Pipelines
+ * are separated by ;, && or ||, stages by |. <, >, >>, 1>, 1>>, 2> and 2>>
+ * take the next word as a file for the stage, and <&M, >&M, 1>&M and 2>&M
+ * make the descriptor a copy of M, which is 0, 1 or 2. Words with an unquoted
+ * *, ? or [...] are glob patterns, deferred the same way and expanded once the
+ * pipeline is parsed with expand; in them quoted or escaped pattern characters
+ * are kept behind a backslash. Returns NULL after printing a message if the
+ * line is malformed */
+parsed_line* parse_line(arena* a, char* line, bool expand) {
+    size_t len = strlen(line);
+    char* out = arena_alloc(a, 2 * len + 1); // unquoted words, escapes in patterns at most double a quoted run
+    char* out_end = out + 2 * len + 1; // a variable's value can outgrow it, see grow_word
+    
+    // word pointers, with a NULL ending every stage, plus where stages and pipelines begin
+    int num_words = 0, words_size = 16, num_patterns = 0;
+    char** words = arena_alloc(a, words_size * sizeof(char*));
+    bool* patterns = arena_alloc(a, words_size * sizeof(bool)); // which words are glob patterns
+    int num_stages = 0, stages_size = 8;
+    int* stage_starts = arena_alloc(a, stages_size * sizeof(int));
+    redirect* stage_io = arena_alloc(a, stages_size * sizeof(redirect));
+    int num_pipelines = 0, pipelines_size = 4;
+    int* pipeline_starts = arena_alloc(a, pipelines_size * 3 * sizeof(int)); // first stage, text start, text end
+    int* connectors = arena_alloc(a, pipelines_size * sizeof(int));
+    bool* deferred = arena_alloc(a, pipelines_size * sizeof(bool));
+    int next_connector = CONNECT_ALWAYS;
+    
+    char* src = line;
+    char* dst = out;
+    char* error = NULL;
+    bool new_pipeline = true, new_stage = true;
+    while (error == NULL) {
+        if (new_pipeline) {
+            if (num_pipelines == pipelines_size) {
+                pipeline_starts = arena_grow(a, pipeline_starts, pipelines_size * 3 * sizeof(int), pipelines_size * 6 * sizeof(int));
+                connectors = arena_grow(a, connectors, pipelines_size * sizeof(int), pipelines_size * 2 * sizeof(int));
+                deferred = arena_grow(a, deferred, pipelines_size * sizeof(bool), pipelines_size * 2 * sizeof(bool));
+                pipelines_size *= 2;
+            }
+            connectors[num_pipelines] = next_connector;
+            deferred[num_pipelines] = false;
+            pipeline_starts[num_pipelines * 3] = num_stages;
+            pipeline_starts[num_pipelines * 3 + 1] = src - line;
+            num_pipelines++;
+            new_pipeline = false;
+        }
+        if (new_stage) {
+            if (num_stages == stages_size) {
+                stage_starts = arena_grow(a, stage_starts, stages_size * sizeof(int), stages_size * 2 * sizeof(int));
+                stage_io = arena_grow(a, stage_io, stages_size * sizeof(redirect), stages_size * 2 * sizeof(redirect));
+                stages_size *= 2;
+            }
+            memset(&stage_io[num_stages], 0, sizeof(redirect));
+            memset(stage_io[num_stages].copies, -1, sizeof(stage_io[num_stages].copies));
+            stage_starts[num_stages++] = num_words;
+            new_stage = false;
+        }
+        
+        while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') src++;
+        if (num_words + 2 > words_size) { // room for a word and the NULL after it
+            words = arena_grow(a, words, words_size * sizeof(char*), words_size * 2 * sizeof(char*));
+            patterns = arena_grow(a, patterns, words_size * sizeof(bool), words_size * 2 * sizeof(bool));
+            words_size *= 2;
+        }
+        
+        int target = -1; // a redirection takes the next word as its file
+        if (*src == '<' || *src == '>' || ((src[0] == '1' || src[0] == '2') && src[1] == '>')) {
+            target = *src == '<' ? 0 : *src == '>' || *src == '1' ? 1 : 2;
+            src += *src == '1' || *src == '2' ? 2 : 1;
+            stage_io[num_stages - 1].append[target] = target > 0 && *src == '>';
+            if (stage_io[num_stages - 1].append[target]) src++;
+            if (*src == '&' && src[1] != '&') { // N>&M, with M one of 0, 1 and 2
+                redirect* io = &stage_io[num_stages - 1];
+                if (io->append[target] || src[1] < '0' || src[1] > '2' || (src[2] != '\0' && strchr(" \t\r\n;|<>&", src[2]) == NULL)) {
+                    error = "descriptor to copy must be 0, 1 or 2";
+                    break;
+                }
+                io->copies[target] = src[1] - '0';
+                io->copies_original[target] = io->files[src[1] - '0'] == NULL;
+                io->files[target] = NULL;
+                src += 2;
+                continue;
+            }
+            while (*src == ' ' || *src == '\t') src++;
+            if (*src == '\0' || strchr(";|<>&\r\n", *src) != NULL) {
+                error = "missing file name after redirection";
+                break;
+            }
+        }
+        
+        bool conditional = (src[0] == '&' && src[1] == '&') || (src[0] == '|' && src[1] == '|');
+        if (*src != '\0' && *src != ';' && *src != '|' && !conditional) {
+            char* word = dst;
+            bool pattern = false, bracket = false, escaped = false, quoted = false, expanded = false;
+            while (error == NULL && *src != '\0') {
+                char c = *src;
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '|' || c == '<' || c == '>') break;
+                if (c == '&' && src[1] == '&') break;
+                src++;
+                if (c == '\\') {
+                    if (*src == '\0') continue;
+                    if (strchr("*?[]\\", *src) != NULL) {
+                        *dst++ = '\\';
+                        escaped = true;
+                    }
+                    *dst++ = *src++;
+                } else if (c == '\'') {
+                    quoted = true;
+                    while (*src != '\0' && *src != '\'') {
+                        if (strchr("*?[]\\", *src) != NULL) {
+                            *dst++ = '\\';
+                            escaped = true;
+                        }
+                        *dst++ = *src++;
+                    }
+                    if (*src == '\0') error = "unterminated single quote";
+                    else src++;
+                } else if (c == '"') {
+                    quoted = true;
+                    while (error == NULL && *src != '\0' && *src != '"') {
+                        char* after;
+                        char* value = *src == '$' ? variable_at(src + 1, &after) : NULL;
+                        if (value != NULL && !expand) {
+                            deferred[num_pipelines - 1] = true;
+                            while (src < after) *dst++ = *src++;
+                            continue;
+                        }
+                        if (value != NULL) {
+                            dst = grow_word(a, &word, dst, &out_end, 2 * (strlen(value) + len - (src - line)) + 1);
+                            dst = copy_value(dst, value, &escaped);
+                            src = after;
+                            continue;
+                        }
+                        if (*src == '$' && after == NULL) {
+                            error = "bad ${} substitution";
+                            break;
+                        }
+                        if (*src == '\\' && (src[1] == '"' || src[1] == '\\' || src[1] == '$')) src++;
+                        if (strchr("*?[]\\", *src) != NULL) {
+                            *dst++ = '\\';
+                            escaped = true;
+                        }
+                        *dst++ = *src++;
+                    }
+                    if (error != NULL) break;
+                    if (*src == '\0') error = "unterminated double quote";
+                    else src++;
+                } else if (c == '$') {
+                    char* after;
+                    char* value = variable_at(src, &after);
+                    if (value != NULL && !expand) {
+                        deferred[num_pipelines - 1] = true;
+                        *dst++ = c;
+                        while (src < after) *dst++ = *src++;
+                    } else if (value != NULL) {
+                        dst = grow_word(a, &word, dst, &out_end, 2 * (strlen(value) + len - (src - line)) + 1);
+                        dst = copy_value(dst, value, &escaped);
+                        src = after;
+                        expanded = true;
+                    } else if (after == NULL) {
+                        error = "bad ${} substitution";
+                    } else {
+                        *dst++ = c; // not followed by a name
+                    }
+                } else {
+                    if (c == '*' || c == '?' || (c == ']' && bracket)) pattern = true;
+                    if (c == '[') bracket = true; // a [ with no ] after it is an ordinary character
+                    *dst++ = c;
+                }
+            }
+            *dst++ = '\0';
+            if (expanded && !quoted && word[0] == '\0' && target < 0) {
+                dst = word; // an unset variable on its own is no word at all
+                continue;
+            }
+            if (target >= 0) pattern = false; // file names are taken as they are
+            if (pattern && !expand) {
+                deferred[num_pipelines - 1] = true; // the files may not exist until a command before it has run
+                pattern = false;
+            }
+            if (escaped && !pattern) dst = unescape_word(word) + 1;
+            if (target >= 0) {
+                stage_io[num_stages - 1].files[target] = word;
+                stage_io[num_stages - 1].copies[target] = -1; // the later redirection wins
+                continue;
+            }
+            num_patterns += pattern;
+            patterns[num_words] = pattern;
+            words[num_words++] = word;
+            continue;
+        }
+        
+        // an operator or the end of the line closes the stage
+        bool empty = num_words == stage_starts[num_stages - 1];
+        bool first_stage = pipeline_starts[(num_pipelines - 1) * 3] == num_stages - 1;
+        if (empty && first_stage && connectors[num_pipelines - 1] != CONNECT_ALWAYS) {
+            error = "missing command after && or ||";
+            break;
+        }
+        if (empty && first_stage && conditional) {
+            error = "missing command before && or ||";
+            break;
+        }
+        if (empty && ((*src == '|' && !conditional) || !first_stage)) {
+            error = "empty command in pipeline";
+            break;
+        }
+        redirect* io = &stage_io[num_stages - 1];
+        if (empty && (redirected(io, 0) || redirected(io, 1) || redirected(io, 2))) {
+            error = "redirection without a command";
+            break;
+        }
+        patterns[num_words] = false;
+        words[num_words++] = NULL;
+        if (*src == '|' && !conditional) {
+            new_stage = true;
         } else {
-            return; //error
+            pipeline_starts[(num_pipelines - 1) * 3 + 2] = src - line;
+            new_pipeline = new_stage = true;
+            next_connector = !conditional ? CONNECT_ALWAYS : *src == '&' ? CONNECT_AND : CONNECT_OR;
         }
-    } else {
-        chdir(dir);
+        if (*src == '\0') break;
+        src += conditional ? 2 : 1;
+    }
+    if (error != NULL) {
+        printf("Syntax error: %s.\n", error);
+        return NULL;
+    }
+    
+    if (num_patterns > 0) words = expand_globs(a, words, &num_words, patterns, stage_starts, num_stages);
+    
+    // turn the indices into stages and pipelines now that the arrays have stopped moving
+    parsed_line* parsed = arena_alloc(a, sizeof(parsed_line));
+    parsed->pipelines = arena_alloc(a, num_pipelines * sizeof(pipeline));
+    parsed->num_pipelines = 0;
+    stage* stages = arena_alloc(a, num_stages * sizeof(stage));
+    int i;
+    for (i = 0; i < num_stages; i++) {
+        stages[i].argv = &words[stage_starts[i]];
+        stages[i].io = stage_io[i];
+    }
+    for (i = 0; i < num_pipelines; i++) {
+        int first = pipeline_starts[i * 3];
+        int last = i + 1 < num_pipelines ? pipeline_starts[(i + 1) * 3] : num_stages;
+        if (stages[first].argv[0] == NULL) continue; // nothing between two ;
+        
+        pipeline* command = &parsed->pipelines[parsed->num_pipelines++];
+        command->stages = &stages[first];
+        command->num_stages = last - first;
+        command->connector = connectors[i];
+        command->deferred = deferred[i];
+        int start = pipeline_starts[i * 3 + 1], end = pipeline_starts[i * 3 + 2];
+        while (start < end && strchr(" \t\r\n", line[start]) != NULL) start++;
+        while (end > start && strchr(" \t\r\n", line[end - 1]) != NULL) end--;
+        command->text = arena_alloc(a, end - start + 1);
+        memcpy(command->text, line + start, end - start);
+        command->text[end - start] = '\0';
+    }
+    return parsed;
+}
+
+/* replaces every pattern word with the names it matches, sorted, or with the
+ * pattern itself when nothing matches. Stage starts are moved to match */
+char** expand_globs(arena* a, char** words, int* num_words, bool* patterns, int* stage_starts, int num_stages) {
+    glob_state g = {a, NULL, NULL, 0, 0};
+    int size = *num_words * 2, count = 0, stage = 0, i;
+    char** expanded = arena_alloc(a, size * sizeof(char*));
+    for (i = 0; i < *num_words; i++) {
+        if (stage < num_stages && stage_starts[stage] == i) stage_starts[stage++] = count;
+        int n = 1;
+        if (patterns[i]) {
+            g.num_matches = 0;
+            expand_pattern(&g, words[i]);
+            n = g.num_matches;
+        }
+        if (count + n > size) {
+            expanded = arena_grow(a, expanded, size * sizeof(char*), (count + n) * 2 * sizeof(char*));
+            size = (count + n) * 2;
+        }
+        if (patterns[i]) memcpy(&expanded[count], g.matches, n * sizeof(char*));
+        else expanded[count] = words[i];
+        count += n;
+    }
+    *num_words = count;
+    return expanded;
+}
+
+void expand_pattern(glob_state* g, char* pattern) {
+    char* rest = pattern;
+    while (*rest == '/') rest++;
+    glob_dir(g, rest != pattern ? "/" : "", rest);
+    if (g->num_matches == 0) {
+        unescape_word(pattern); // nothing matched, the word stands for itself
+        add_match(g, pattern);
         return;
     }
-    printf("Directory %s not found.\n", dir);
+    qsort(g->matches, g->num_matches, sizeof(char*), compare_matches);
+}
+
+/* matches rest, what is left of a pattern, against the names below prefix, a
+ * path ending in / or empty for the working directory. Components without
+ * pattern characters are joined on without reading the directory */
+void glob_dir(glob_state* g, char* prefix, char* rest) {
+    char* slash = strchr(rest, '/');
+    size_t prefix_len = strlen(prefix), part_len = slash != NULL ? (size_t) (slash - rest) : strlen(rest);
+    char* part = arena_alloc(g->a, part_len + 1);
+    memcpy(part, rest, part_len);
+    part[part_len] = '\0';
+    char* next = slash;
+    while (next != NULL && *next == '/') next++;
+    if (next != NULL && *next == '\0') next = NULL; // a trailing / only asks for directories
+    
+    // the literal start of the part, unescaped, bounds the names worth matching
+    char* literal = arena_alloc(g->a, part_len + 1);
+    size_t literal_len = 0, i;
+    for (i = 0; i < part_len && strchr("*?[", part[i]) == NULL; i++) {
+        if (part[i] == '\\' && i + 1 < part_len) i++;
+        literal[literal_len++] = part[i];
+    }
+    literal[literal_len] = '\0';
+    
+    if (i == part_len) { // nothing to match in this part
+        char* path = arena_alloc(g->a, prefix_len + literal_len + 2);
+        sprintf(path, "%s%s", prefix, literal);
+        struct stat info;
+        if (next == NULL && slash == NULL) {
+            if (lstat(path, &info) == 0) add_match(g, path);
+        } else if (next == NULL) {
+            if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) add_match(g, strcat(path, "/"));
+        } else {
+            glob_dir(g, strcat(path, "/"), next);
+        }
+        return;
+    }
+    
+    dir_listing* dir = list_directory(g, prefix);
+    if (dir == NULL) return;
+    int low = 0, high = dir->count;
+    while (low < high) { // first name not below the literal start
+        int mid = (low + high) / 2;
+        if (strcmp(dir->entries[mid].name, literal) < 0) low = mid + 1;
+        else high = mid;
+    }
+    int j;
+    for (j = low; j < dir->count && strncmp(dir->entries[j].name, literal, literal_len) == 0; j++) {
+        char* name = dir->entries[j].name;
+        if (name[0] == '.' && part[0] != '.') continue; // hidden unless asked for
+        if (!match_glob(part, name)) continue;
+        char* path = arena_alloc(g->a, prefix_len + strlen(name) + 2);
+        sprintf(path, "%s%s", prefix, name);
+        if (slash == NULL) {
+            add_match(g, path);
+            continue;
+        }
+        unsigned char type = dir->entries[j].type;
+        struct stat info;
+        if (type != DT_DIR && (type == DT_UNKNOWN || type == DT_LNK) && stat(path, &info) == 0 && S_ISDIR(info.st_mode)) type = DT_DIR;
+        if (type != DT_DIR) continue;
+        if (next == NULL) add_match(g, strcat(path, "/"));
+        else glob_dir(g, strcat(path, "/"), next);
+    }
+}
+
+// reads a directory the first time a pattern needs it, later ones get the cached entries
+dir_listing* list_directory(glob_state* g, char* path) {
+    if (path[0] == '\0') path = ".";
+    dir_listing* dir;
+    for (dir = g->listings; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) return dir;
+    }
+    DIR* stream = opendir(path);
+    if (stream == NULL) return NULL;
+    
+    dir = arena_alloc(g->a, sizeof(dir_listing));
+    dir->path = arena_alloc(g->a, strlen(path) + 1);
+    strcpy(dir->path, path);
+    dir->count = 0;
+    int size = 64;
+    dir->entries = arena_alloc(g->a, size * sizeof(dir_entry));
+    struct dirent* entry;
+    while ((entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (dir->count == size) {
+            dir->entries = arena_grow(g->a, dir->entries, size * sizeof(dir_entry), size * 2 * sizeof(dir_entry));
+            size *= 2;
+        }
+        size_t len = strlen(entry->d_name);
+        dir_entry* current = &dir->entries[dir->count++];
+        current->name = arena_alloc(g->a, len + 1);
+        memcpy(current->name, entry->d_name, len + 1);
+        current->type = entry->d_type;
+    }
+    closedir(stream);
+    qsort(dir->entries, dir->count, sizeof(dir_entry), compare_entries);
+    dir->next = g->listings;
+    g->listings = dir;
+    return dir;
+}
+
+int compare_entries(const void* a, const void* b) {
+    return strcmp(((const dir_entry*) a)->name, ((const dir_entry*) b)->name);
+}
+
+int compare_matches(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void add_match(glob_state* g, char* match) {
+    if (g->num_matches == g->matches_size) {
+        int size = g->matches_size > 0 ? g->matches_size * 2 : 64;
+        g->matches = arena_grow(g->a, g->matches, g->matches_size * sizeof(char*), size * sizeof(char*));
+        g->matches_size = size;
+    }
+    g->matches[g->num_matches++] = match;
+}
+
+/* * matches any run of characters, ? any one, [...] one from a set and a
+ * backslash makes the next character literal. A * only backtracks to the
+ * most recent *, so matching is linear in practice */
+bool match_glob(char* pattern, char* name) {
+    char* star = NULL;
+    char* star_name = NULL;
+    while (*name != '\0') {
+        char* end;
+        int bracket = *pattern == '[' ? match_bracket(pattern, *name, &end) : -1;
+        if (*pattern == '*') {
+            star = ++pattern;
+            star_name = name;
+            continue;
+        }
+        if (*pattern == '?' || bracket == 1) {
+            pattern = *pattern == '?' ? pattern + 1 : end;
+            name++;
+            continue;
+        }
+        char literal = *pattern == '\\' && pattern[1] != '\0' ? pattern[1] : *pattern;
+        if (bracket == -1 && literal != '\0' && literal == *name) {
+            pattern += *pattern == '\\' && pattern[1] != '\0' ? 2 : 1;
+            name++;
+            continue;
+        }
+        if (star == NULL) return false;
+        pattern = star;
+        name = ++star_name;
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+/* matches c against the bracket expression at pattern: [abc], [a-z] or [!x].
+ * Returns 1 or 0 with end just past the ], or -1 when there is no closing ]
+ * and the [ is an ordinary character */
+int match_bracket(char* pattern, char c, char** end) {
+    char* p = pattern + 1;
+    bool negate = *p == '!' || *p == '^';
+    if (negate) p++;
+    bool found = false, first = true;
+    while (*p != ']' || first) { // a ] straight after the [ is one of the set
+        if (*p == '\0') return -1;
+        char low = *p == '\\' && p[1] != '\0' ? *++p : *p;
+        char high = low;
+        p++;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            high = *p == '\\' && p[1] != '\0' ? *++p : *p;
+            p++;
+        }
+        if ((unsigned char) c >= (unsigned char) low && (unsigned char) c <= (unsigned char) high) found = true;
+        first = false;
+    }
+    *end = p + 1;
+    return found != negate;
+}
+
+// drops the backslashes parse_line kept in front of pattern characters, returns the new end
+char* unescape_word(char* word) {
+    char* src = word;
+    char* dst = word;
+    while (*src != '\0') {
+        if (*src == '\\' && src[1] != '\0') src++;
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+    return dst;
+}
+
+/* loads the environment the shell started with as exported variables */
+void init_variables() {
+    char** entry;
+    for (entry = environ; *entry != NULL; entry++) {
+        char* equals = strchr(*entry, '=');
+        if (equals != NULL) set_variable(*entry, equals - *entry, equals + 1, true);
+    }
+}
+
+void free_variables() {
+    int i;
+    for (i = 0; i < VAR_TABLE_SIZE; i++) {
+        while (variables.buckets[i] != NULL) {
+            variable* tmp = variables.buckets[i];
+            variables.buckets[i] = tmp->next;
+            free(tmp->name);
+            free(tmp->entry);
+            free(tmp);
+        }
+    }
+    free(variables.envp);
+    free(variables.exported);
+    memset(&variables, 0, sizeof(variables));
+}
+
+// name need not be NUL terminated, len says where it ends
+variable* find_variable(char* name, size_t len) {
+    unsigned int hash = 5381;
+    size_t i;
+    for (i = 0; i < len; i++) hash = ((hash << 5) + hash) + name[i];
+    variable* current = variables.buckets[hash % VAR_TABLE_SIZE];
+    while (current != NULL && (strncmp(current->name, name, len) != 0 || current->name[len] != '\0')) {
+        current = current->next;
+    }
+    return current;
+}
+
+// the value, or NULL when the variable is not set
+char* get_variable(char* name) {
+    variable* var = find_variable(name, strlen(name));
+    return var != NULL ? strchr(var->entry, '=') + 1 : NULL;
+}
+
+/* an exported variable's new entry goes straight into its envp slot, so
+ * exec sees it without the array being built again */
+void set_variable(char* name, size_t len, char* value, bool export) {
+    variable* var = find_variable(name, len);
+    if (var == NULL) {
+        unsigned int hash = 5381;
+        size_t i;
+        for (i = 0; i < len; i++) hash = ((hash << 5) + hash) + name[i];
+        var = (variable*) calloc(1, sizeof(variable));
+        var->name = strndup(name, len);
+        var->env_slot = -1;
+        var->next = variables.buckets[hash % VAR_TABLE_SIZE];
+        variables.buckets[hash % VAR_TABLE_SIZE] = var;
+    }
+    char* entry = (char*) malloc(len + strlen(value) + 2);
+    sprintf(entry, "%s=%s", var->name, value);
+    free(var->entry);
+    var->entry = entry;
+    if (var->env_slot >= 0) {
+        variables.envp[var->env_slot] = entry;
+        drop_queue_context(); // queued jobs keep the old value
+    } else if (export) export_variable(var);
+}
+
+// gives the variable the next envp slot
+void export_variable(variable* var) {
+    if (var->env_slot >= 0) return;
+    if (variables.num_exported + 1 >= variables.envp_size) {
+        variables.envp_size = variables.envp_size > 0 ? variables.envp_size * 2 : 64;
+        variables.envp = (char**) realloc(variables.envp, variables.envp_size * sizeof(char*));
+        variables.exported = (variable**) realloc(variables.exported, variables.envp_size * sizeof(variable*));
+    }
+    drop_queue_context();
+    var->env_slot = variables.num_exported++;
+    variables.envp[var->env_slot] = var->entry;
+    variables.exported[var->env_slot] = var;
+    variables.envp[variables.num_exported] = NULL;
+}
+
+// an exported variable's slot is filled by the last one in envp
+void unset_variable(char* name) {
+    unsigned int hash = 5381;
+    char* c;
+    for (c = name; *c != '\0'; c++) hash = ((hash << 5) + hash) + *c;
+    variable** link = &variables.buckets[hash % VAR_TABLE_SIZE];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    if (*link == NULL) return;
+    
+    variable* var = *link;
+    *link = var->next;
+    if (var->env_slot >= 0) {
+        drop_queue_context();
+        variable* last = variables.exported[--variables.num_exported];
+        variables.envp[var->env_slot] = last->entry;
+        variables.exported[var->env_slot] = last;
+        last->env_slot = var->env_slot;
+        variables.envp[variables.num_exported] = NULL;
+    }
+    free(var->name);
+    free(var->entry);
+    free(var);
+}
+
+// length of the variable name at the start of name, 0 if there is none
+size_t variable_name_length(char* name) {
+    size_t len = 0;
+    if (!isalpha((unsigned char) name[0]) && name[0] != '_') return 0;
+    while (isalnum((unsigned char) name[len]) || name[len] == '_') len++;
+    return len;
+}
+
+bool is_assignment(char* word) {
+    size_t len = variable_name_length(word);
+    return len > 0 && word[len] == '=';
+}
+
+// NAME=value, reloading the path when it is PATH that changed
+bool assign_variable(char* assignment, bool export, path* head) {
+    size_t len = variable_name_length(assignment);
+    if (len == 0 || assignment[len] != '=') return false;
+    set_variable(assignment, len, assignment + len + 1, export);
+    if (len == 4 && strncmp(assignment, "PATH", 4) == 0) reload_path(head);
+    return true;
+}
+
+/* the value of the variable named at src, just past a $: NAME or {NAME}.
+ * Sets end past the name. Unset variables are empty. NULL with end at src
+ * when no name follows, so the $ is literal, and NULL with end NULL for a
+ * malformed ${} */
+char* variable_at(char* src, char** end) {
+    bool braced = *src == '{';
+    size_t len = variable_name_length(src + braced);
+    *end = src;
+    if (len == 0 && !braced) return NULL;
+    if (braced && (len == 0 || src[1 + len] != '}')) {
+        *end = NULL;
+        return NULL;
+    }
+    *end = src + len + (braced ? 2 : 0);
+    variable* var = find_variable(src + braced, len);
+    return var != NULL ? strchr(var->entry, '=') + 1 : "";
+}
+
+// copies a value into a word with its pattern characters kept literal
+char* copy_value(char* dst, char* value, bool* escaped) {
+    for (; *value != '\0'; value++) {
+        if (strchr("*?[]\\", *value) != NULL) {
+            *dst++ = '\\';
+            *escaped = true;
+        }
+        *dst++ = *value;
+    }
+    return dst;
+}
+
+/* parse_line writes words into one buffer sized for the line. A value can
+ * outgrow it; the word being written then moves to a bigger buffer and the
+ * words before it stay where they are */
+char* grow_word(arena* a, char** word, char* dst, char** out_end, size_t needed) {
+    if (dst + needed <= *out_end) return dst;
+    size_t partial = dst - *word, size = (partial + needed) * 2;
+    char* fresh = arena_alloc(a, size);
+    memcpy(fresh, *word, partial);
+    *word = fresh;
+    *out_end = fresh + size;
+    return fresh + partial;
+}
+
+/* what exec passes on: the exported variables, or our own environment before
+ * they are loaded. A queued job gets those of when it was queued */
+char** exec_environment() {
+    if (running_context != NULL) return running_context->envp;
+    return variables.envp != NULL ? variables.envp : environ;
+}
+
+/* PATH changed. The directories are loaded again into the list every caller
+ * already holds, so head stays valid, and the lookup cache is emptied */
+void reload_path(path* head) {
+    path* fresh = load_environment();
+    free_path(head->next);
+    *head = *fresh;
+    free(fresh);
+    clear_command_cache();
+}
+
+/* resolves a command against the path. A cached command costs no syscall; the
+ * price is one stat per path directory on the first lookup of each line, and
+ * a miss still tries every directory in turn */
+char* is_valid_command(char* command, path* head) {
+    struct stat statresult;
+    if (strchr(command, '/') != NULL) { // explicit paths are never looked up or cached
+        if (stat(command, &statresult) == 0) return strdup(command);
+        return NULL;
+    }
+
+    if (!command_cache.checked) {
+        // something may have been installed that shadows or removes a cached command
+        if (path_changed(head)) clear_command_cache();
+        command_cache.checked = true;
+    }
+    cmd_cache_entry* cached = find_cached_command(command);
+    if (cached != NULL) {
+        command_cache.hits++;
+        cached->hits++;
+        return strdup(cached->full_path);
+    }
+    command_cache.misses++;
+
+    path* temp = head;
+    while (temp != NULL) {        
+	    // add string to each path
+        char comm[1024]= "";
+        int stat_res = 0;    
+        strcat(comm, temp->path_var);
+        strcat(comm, "/");
+        strcat(comm, command);
+        stat_res = stat(comm, &statresult);
+        if (stat_res == 0) {
+            char* ret = calloc(strlen(comm) + 1, sizeof(char));
+            strcpy(ret, comm);
+            // relative directories like . change meaning with cd so they are not cached
+            if (temp->path_var[0] == '/') cache_command(command, comm);
+            return ret;
+        }        		        
+        temp = temp->next;
+    }
+    return NULL;
+}
+
+//free arrays of arrays
+void free_tokens(char** tokens) {
+    int j;
+    for (j = 0; tokens[j] != NULL; j++) {
+	    free(tokens[j]);
+    }
+    free(tokens);
+}	
+
+//find previous directory
+char* previous_directory(char* dir) {
+    char* prev = calloc(strlen(dir), sizeof(char));
+    int i;
+    
+    //search from the back for first slash
+    for (i = strlen(dir) - 1; i >= 0; i--) {
+        if(dir[i] == '/') {
+            strncpy(prev, dir, i);
+            prev[i] = '\0';
+            break;
+        }
+    }
+    return prev;
+}
+
+void change_directory(char* dir) {
+    if (dir == NULL) {
+        chdir("/home/chav"); //go to root directory
+        return;
+    }
+    
+    char cwd[1024];
+   	if (getcwd(cwd, sizeof(cwd)) == NULL)
+       perror("getcwd() error");
+    
+    if (strcmp(dir, ".") == 0) {
+        //current directory
+        return;
+    } else if (strcmp(dir, "..") == 0)  { //go to previous directory
+        char* prev_dir = previous_directory(cwd);
+        chdir(prev_dir);
+        free(prev_dir);
+        return;
+    } else if ((strstr("/", dir) != NULL)) { //if the string contains no slashes assume it is the cwd
+        char * new_str ;
+        int i;
+        for (i = 0; cwd[i] != '\0'; i++);
+
+        cwd[i] = '/';
+        cwd[i + 1] = '\0';
+     
+        //concatenate string to directory
+        if((new_str = calloc(strlen(cwd)+strlen(dir)+1, sizeof(char*))) != NULL){
+            new_str[0] = '\0';   // ensures the memory is an empty string
+            strcat(new_str,cwd);
+            strcat(new_str,dir);
+            chdir(new_str);
+            free(new_str);
+            return;
+        } else {
+            return; //error
+        }
+    } else {
+        chdir(dir);
+        return;
+    }
+    printf("Directory %s not found.\n", dir);
+}
+
+/* keep sorted by name, find_builtin does a binary search */
+builtin builtins [] = {
+    {"cat",     builtin_cat,     "cat [file ...]: write the files, or standard input, to standard output; with options the cat program runs"},
+    {"cd",      builtin_cd,      "cd [dir]: change the working directory"},
+    {"echo",    builtin_echo,    "echo [-n] [arg ...]: print the arguments"},
+    {"exit",    builtin_exit,    "exit [status]: leave the shell once no jobs are running"},
+    {"export",  builtin_export,  "export [name[=value] ...]: set variables and pass them to commands, or list those passed"},
+    {"hash",    builtin_hash,    "hash [-r] [command ...]: show, clear or fill the command lookup cache"},
+    {"help",    builtin_help,    "help [builtin]: describe the builtin commands"},
+    {"history", builtin_history, "history [n | -s text | -p prefix]: list, or search, previously entered commands"},
+    {"jobs",    builtin_jobs,    "jobs [-v]: list running and queued background jobs, -v adds resource use and recently finished commands"},
+    {"limit",   builtin_limit,   "limit [-t cpu seconds] [-m address space MB] [-n open files] [-N nice] [-i idle|be:n|rt:n] [command ...]: limit one command, or every command started after"},
+    {"mode",    builtin_mode,    "mode [parallel|p|sequential|s] [max jobs]: show or change the execution mode"},
+    {"output",  builtin_output,  "output [direct|line|group]: show or change how the output of parallel jobs is written"},
+    {"pause",   builtin_pause,   "pause pid: stop a background job"},
+    {"pipesize", builtin_pipesize, "pipesize [bytes]: show or set the buffer size of pipeline pipes"},
+    {"pwd",     builtin_pwd,     "pwd: print the working directory"},
+    {"resume",  builtin_resume,  "resume pid: continue a paused job"},
+    {"run-dag", builtin_run_dag, "run-dag [-j max jobs] file: run the steps in file, each once the steps it needs have succeeded"},
+    {"stats",   builtin_stats,   "stats [-r | -j]: show how long each phase of running a command takes, -r resets, -j prints json"},
+    {"tee",     builtin_tee,     "tee [file ...]: copy standard input to standard output and each file"},
+    {"time",    builtin_time,    "time command [arg ...]: run a command and report the time it took"},
+    {"type",    builtin_type,    "type name ...: tell how each name would be run"},
+    {"unset",   builtin_unset,   "unset name ...: remove variables"},
+    {"wait",    builtin_wait,    "wait [-n] [pid ...]: wait for background jobs to finish and return their status"},
+};
+static const int NUM_BUILTINS = sizeof(builtins) / sizeof(builtins[0]);
+
+int compare_builtin(const void* name, const void* entry) {
+    return strcmp((const char*) name, ((const builtin*) entry)->name);
+}
+
+builtin* find_builtin(char* command) {
+    return bsearch(command, builtins, NUM_BUILTINS, sizeof(builtin), compare_builtin);
+}
+
+bool is_built_in_command(char* command) {
+    return find_builtin(command) != NULL;
+}
+
+/* whether a command line runs as a builtin. cat only copies plain files and
+ * standard input itself; with an option the cat program runs instead */
+bool runs_builtin(char** params) {
+    if (!is_built_in_command(params[0])) return false;
+    if (strcmp(params[0], "cat") != 0) return true;
+    int i;
+    for (i = 1; params[i] != NULL; i++) {
+        if (params[i][0] == '-' && params[i][1] != '\0') return false;
+    }
+    return true;
+}
+
+path* list_append(char* curr, path *list) {
+    path *current = list;
+    path *newNode = (path*) calloc(1, sizeof(path));
+    if (newNode == NULL) { //case where malloc fails 
+        fprintf(stderr, "Failed to create new node to add.\n");
+        return list;
+    }
+    strcpy(newNode->path_var, curr);
+    newNode->next = NULL;
+    
+    // adding to an empty list
+    if (list == NULL) {
+        //list = newNode; unnecessary assignement
+        return newNode;
+    }
+    
+    // general case
+    while (current != NULL) {
+        current = current->next;
+    }
+    
+    current = newNode;
+    return list;
+}
+
+void list_clear(path *list) {
+    while (list != NULL) {
+        path *tmp = list;
+        list = list->next;
+        free(tmp);
+    }
+}
+
+bool change_mode(char* mode_str, program_state** p_state) {
+    if (mode_str == NULL){
+        if ((*p_state)->mode == 0) {
+            printf("Running in sequential mode.\n");
+        }
+        if ((*p_state)->mode == 1) {
+            printf("Running in parallel mode.\n");
+        }
+    } else if (strcmp(mode_str, "parallel") == 0 || strcmp(mode_str, "p") == 0) {
+        return true;
+    } else if (strcmp(mode_str, "sequential") == 0 || strcmp(mode_str, "s") == 0) {
+        return false;
+    } else {
+        printf("Unrecognised mode: %s.\nValid entires are parallel or p, or sequential or s.\n", mode_str);
+    }
+    // default case is to return the current mode
+    return (*p_state)->in_parallel;
+}
+
+// only async-signal-safe calls in here, reap_children does the work
+void sig_comm(int sig) {
+    int saved_errno = errno;
+    write(sigchld_pipe[1], "c", 1); // a full pipe is fine, a wakeup is already pending
+    errno = saved_errno;
+}
+
+path* load_path_from_list(char** environment) {
+    path* head = (path*) calloc(1, sizeof(path)); //calloc so the compiler doesn't complain about unitialised variables
+    
+    path* current = head;
+    int i;
+    
+    for (i = 0; environment[i] != NULL; i++) {
+        int len = strlen(environment[i]);
+        strncpy(current->path_var, environment[i], len); // copy everything but the empty space
+        current->next = (path*) calloc(1, sizeof(path));
+        current = current->next;
+    }
+    current->next = NULL;  
+    
+    return head; 
+}
+
+path *load_path(const char *filename) {
+    FILE* file = fopen(filename, "r"); 
+    if (file == NULL) {
+        printf("Failed to open %s. Now terminating program.\n", filename);
+        exit(1);
+    }
+    
+    path* head = (path*) calloc(1, sizeof(path*)); //calloc so the compiler doesn't complain about unitialised variables
+    
+    path* current = head;
+    
+    char current_word[256]; // a bit large so the user can add their own directories into the path
+    
+    while (fgets(current_word, 256, file) != NULL) {
+        int len = strlen(current_word);
+        strncpy(current->path_var, current_word, len - 1); // copy everything but the empty space
+        current->next = (path*) calloc(1, sizeof(path));
+        current = current->next;
+    }
+    current->next = NULL;
+    
+    fclose(file);
+    return head;
+}
+
+/* djb2 */
+unsigned int hash_command(char* command) {
+    unsigned int hash = 5381;
+    int c;
+    while ((c = *command++) != '\0')
+        hash = ((hash << 5) + hash) + c;
+    return hash % CMD_CACHE_SIZE;
+}
+
+cmd_cache_entry* find_cached_command(char* command) {
+    cmd_cache_entry* current = command_cache.buckets[hash_command(command)];
+    while (current != NULL && strcmp(current->name, command) != 0) {
+        current = current->next;
+    }
+    return current;
+}
+
+void cache_command(char* command, char* full_path) {
+    if (strlen(command) >= sizeof(((cmd_cache_entry*) 0)->name)) return; // too long to be worth caching
+    cmd_cache_entry* entry = find_cached_command(command);
+    if (entry == NULL) {
+        unsigned int bucket = hash_command(command);
+        entry = (cmd_cache_entry*) calloc(1, sizeof(cmd_cache_entry));
+        if (entry == NULL) return;
+        strcpy(entry->name, command);
+        entry->next = command_cache.buckets[bucket];
+        command_cache.buckets[bucket] = entry;
+    }
+    strncpy(entry->full_path, full_path, sizeof(entry->full_path) - 1);
+}
+
+void clear_command_cache() {
+    int i;
+    for (i = 0; i < CMD_CACHE_SIZE; i++) {
+        cmd_cache_entry* current = command_cache.buckets[i];
+        while (current != NULL) {
+            cmd_cache_entry* tmp = current;
+            current = current->next;
+            free(tmp);
+        }
+        command_cache.buckets[i] = NULL;
+    }
+}
+
+// stats a path directory and records its modification time. returns true if it changed since the last call
+bool path_dir_changed(path* dir) {
+    struct stat statresult;
+    struct timespec mtime = {0, 0};
+    if (stat(dir->path_var, &statresult) == 0) mtime = statresult.st_mtim;
+    
+    bool changed = mtime.tv_sec != dir->mtime.tv_sec || mtime.tv_nsec != dir->mtime.tv_nsec;
+    dir->mtime = mtime;
+    return changed;
+}
+
+// stats every path directory. A new file anywhere can change what a name resolves to
+bool path_changed(path* head) {
+    bool changed = false;
+    path* current;
+    for (current = head; current != NULL; current = current->next) {
+        if (path_dir_changed(current)) changed = true; // keep going so every mtime is current
+    }
+    return changed;
+}
+
+/* the trie keeps its own modification times, path_dir_changed's belong to
+ * the command cache. One stat per path directory tells whether it is still
+ * good, which is all a tab costs until something is installed */
+bool trie_stale(path* head) {
+    if (command_names.nodes == NULL) return true;
+    int i = 0;
+    path* current;
+    for (current = head; current != NULL; current = current->next) {
+        if (current->path_var[0] == '\0') continue;
+        if (i >= command_names.num_dirs || strcmp(command_names.dirs[i], current->path_var) != 0) return true;
+        struct stat statresult;
+        struct timespec mtime = {0, 0};
+        if (stat(current->path_var, &statresult) == 0) mtime = statresult.st_mtim;
+        if (mtime.tv_sec != command_names.mtimes[i].tv_sec || mtime.tv_nsec != command_names.mtimes[i].tv_nsec) return true;
+        i++;
+    }
+    return i != command_names.num_dirs;
+}
+
+// builtins and every executable file on the path
+void build_trie(path* head) {
+    free_trie();
+    command_names.size = 4096;
+    command_names.nodes = malloc(command_names.size * sizeof(trie_node));
+    command_names.nodes[0] = (trie_node) {-1, -1, 0, false};
+    command_names.num_nodes = 1;
+    int i;
+    for (i = 0; i < NUM_BUILTINS; i++) trie_insert(builtins[i].name);
+    
+    path* current;
+    for (current = head; current != NULL; current = current->next) {
+        if (current->path_var[0] == '\0') continue;
+        command_names.dirs = realloc(command_names.dirs, (command_names.num_dirs + 1) * sizeof(char*));
+        command_names.mtimes = realloc(command_names.mtimes, (command_names.num_dirs + 1) * sizeof(struct timespec));
+        command_names.dirs[command_names.num_dirs] = strdup(current->path_var);
+        struct timespec* mtime = &command_names.mtimes[command_names.num_dirs++];
+        struct stat statresult;
+        *mtime = (struct timespec) {0, 0};
+        DIR* dir = opendir(current->path_var);
+        if (dir == NULL) continue;
+        // the time is taken from the open directory so a change while it is read shows next time
+        if (fstat(dirfd(dir), &statresult) == 0) *mtime = statresult.st_mtim;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+            if (faccessat(dirfd(dir), entry->d_name, X_OK, 0) != 0) continue;
+            if (entry->d_type != DT_REG && (fstatat(dirfd(dir), entry->d_name, &statresult, 0) != 0 || S_ISDIR(statresult.st_mode))) continue;
+            trie_insert(entry->d_name);
+        }
+        closedir(dir);
+    }
+}
+
+void free_trie() {
+    int i;
+    for (i = 0; i < command_names.num_dirs; i++) free(command_names.dirs[i]);
+    free(command_names.dirs);
+    free(command_names.mtimes);
+    free(command_names.nodes);
+    memset(&command_names, 0, sizeof(command_names));
+}
+
+void trie_insert(char* name) {
+    size_t len = strlen(name);
+    if (command_names.num_nodes + len >= (size_t) command_names.size) {
+        while (command_names.num_nodes + len >= (size_t) command_names.size) command_names.size *= 2;
+        command_names.nodes = realloc(command_names.nodes, command_names.size * sizeof(trie_node));
+    }
+    trie_node* nodes = command_names.nodes;
+    int node = 0;
+    unsigned char* c;
+    for (c = (unsigned char*) name; *c != '\0'; c++) {
+        int* link = &nodes[node].child;
+        while (*link >= 0 && nodes[*link].c < *c) link = &nodes[*link].sibling;
+        if (*link < 0 || nodes[*link].c != *c) {
+            int fresh = command_names.num_nodes++;
+            nodes[fresh] = (trie_node) {-1, *link, *c, false};
+            *link = fresh;
+        }
+        node = *link;
+    }
+    nodes[node].terminal = true;
+}
+
+// the node the prefix ends at, -1 when no name starts with it
+int trie_find(char* prefix) {
+    trie_node* nodes = command_names.nodes;
+    int node = 0;
+    unsigned char* c;
+    for (c = (unsigned char*) prefix; *c != '\0' && node >= 0; c++) {
+        node = nodes[node].child;
+        while (node >= 0 && nodes[node].c < *c) node = nodes[node].sibling;
+        if (node >= 0 && nodes[node].c != *c) node = -1;
+    }
+    return node;
+}
+
+// names below node in order; name holds the len bytes that lead to it
+void trie_collect(int node, char* name, size_t len, completions* c) {
+    trie_node* nodes = command_names.nodes;
+    if (nodes[node].terminal) {
+        name[len] = '\0';
+        add_completion(c, name, c->num_names < COMPLETION_LIST_MAX);
+    }
+    int child;
+    for (child = nodes[node].child; child >= 0 && len + 1 < PATH_MAX; child = nodes[child].sibling) {
+        name[len] = nodes[child].c;
+        trie_collect(child, name, len + 1, c);
+    }
+}
+
+void complete_command(char* prefix, path* head, completions* c) {
+    if (trie_stale(head)) build_trie(head);
+    int node = trie_find(prefix);
+    if (node < 0) return;
+    char name [PATH_MAX];
+    size_t len = strlen(prefix);
+    memcpy(name, prefix, len);
+    trie_collect(node, name, len, c);
+}
+
+/* names in the word's directory that start with the rest of it. Hidden files
+ * only when that is asked for with a leading dot */
+void complete_file(char* word, completions* c) {
+    char* slash = strrchr(word, '/');
+    size_t dir_len = slash != NULL ? slash - word + 1 : 0;
+    char* dir_name = slash == word ? strdup("/") : slash != NULL ? strndup(word, dir_len - 1) : strdup(".");
+    char* prefix = word + dir_len;
+    size_t prefix_len = strlen(prefix);
+    DIR* dir = opendir(dir_name);
+    free(dir_name);
+    if (dir == NULL) return;
+    
+    struct dirent* entry;
+    char name [PATH_MAX + 2];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) continue;
+        if (entry->d_name[0] == '.' && prefix[0] != '.') continue;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        struct stat statresult;
+        if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && fstatat(dirfd(dir), entry->d_name, &statresult, 0) == 0) {
+            is_dir = S_ISDIR(statresult.st_mode);
+        }
+        snprintf(name, sizeof(name), "%.*s%s%s", (int) dir_len, word, entry->d_name, is_dir ? "/" : "");
+        add_completion(c, name, true);
+    }
+    closedir(dir);
+    qsort(c->names, c->num_names, sizeof(char*), compare_names);
+}
+
+// counts a match and narrows the common prefix, keep adds it to the list
+void add_completion(completions* c, char* name, bool keep) {
+    if (c->count++ == 0) c->common = strdup(name);
+    else {
+        size_t i = 0;
+        while (c->common[i] != '\0' && c->common[i] == name[i]) i++;
+        c->common[i] = '\0';
+    }
+    if (!keep) return;
+    if ((c->num_names & (c->num_names - 1)) == 0) {
+        c->names = realloc(c->names, (c->num_names > 0 ? c->num_names * 2 : 1) * sizeof(char*));
+    }
+    c->names[c->num_names++] = strdup(name);
+}
+
+void free_completions(completions* c) {
+    int i;
+    for (i = 0; i < c->num_names; i++) free(c->names[i]);
+    free(c->names);
+    free(c->common);
+}
+
+int compare_names(const void* a, const void* b) {
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+/* export            lists the exported variables
+ * export name=value sets and exports a variable
+ * export name       exports one that is already set, or an empty one */
+int builtin_export(char** params, path* head, program_state** p_state) {
+    int i, status = 0;
+    if (params[1] == NULL) {
+        for (i = 0; i < variables.num_exported; i++) printf("export %s\n", variables.envp[i]);
+        return 0;
+    }
+    for (i = 1; params[i] != NULL; i++) {
+        if (assign_variable(params[i], true, head)) continue;
+        size_t len = variable_name_length(params[i]);
+        if (len == 0 || params[i][len] != '\0') {
+            printf("export: %s is not a valid name.\n", params[i]);
+            status = 1;
+            continue;
+        }
+        variable* var = find_variable(params[i], len);
+        if (var != NULL) export_variable(var);
+        else set_variable(params[i], len, "", true);
+    }
+    return status;
+}
+
+/* hash        lists the cached commands
+ * hash -r     forgets every cached command
+ * hash cmd... looks up commands ahead of time */
+int builtin_hash(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        int i;
+        printf("hits\tcommand\n");
+        for (i = 0; i < CMD_CACHE_SIZE; i++) {
+            cmd_cache_entry* current = command_cache.buckets[i];
+            for (; current != NULL; current = current->next)
+                printf("%4d\t%s\n", current->hits, current->full_path);
+        }
+        printf("%ld hits, %ld misses.\n", command_cache.hits, command_cache.misses);
+        return 0;
+    }
+    
+    if (strcmp(params[1], "-r") == 0) {
+        clear_command_cache();
+        command_cache.hits = 0;
+        command_cache.misses = 0;
+        return 0;
+    }
+    
+    int i, status = 0;
+    for (i = 1; params[i] != NULL; i++) {
+        char* full_path = is_valid_command(params[i], head);
+        if (full_path == NULL) {
+            printf("hash: %s not found.\n", params[i]);
+            status = 1;
+        }
+        free(full_path);
+    }
+    return status;
+}
+
+// creates a close on exec pipe with the buffer size picked by the pipesize builtin
+int make_pipe(int* pipefd) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) return -1;
+    if (pipe_buffer_size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, pipe_buffer_size) < 0) {
+        int err = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+bool write_all(int fd, char* buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* copies in_fd to out_fd until end of file. splice only works when one side is a
+ * pipe, anything else (a terminal, two files) falls back to read and write */
+bool relay_fd(int in_fd, int out_fd) {
+    bool use_splice = true;
+    char buffer [65536];
+    while (true) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                use_splice = false;
+                continue;
+            }
+        } else {
+            n = read(in_fd, buffer, sizeof(buffer));
+            if (n > 0 && !write_all(out_fd, buffer, n)) return false;
+        }
+        if (n == 0) return true;
+        if (n < 0 && errno != EINTR) return false;
+    }
+}
+
+/* copies in_fd to out_fd and every file. When in_fd and out_fd are pipes each
+ * chunk is duplicated into out_fd with tee(2), copied to all but the last file
+ * through a scratch pipe, and finally spliced (consumed) into the last file.
+ * The scratch pipe is as big as the input so one tee can take the whole
+ * chunk; if it still falls short the chunk is read out and written instead */
+bool tee_fd(int in_fd, int out_fd, int* files, int num_files) {
+    int scratch[2] = {-1, -1};
+    bool use_tee = num_files == 1 || pipe2(scratch, O_CLOEXEC) == 0;
+    int in_size = fcntl(in_fd, F_GETPIPE_SZ);
+    if (scratch[1] >= 0 && in_size > 0) fcntl(scratch[1], F_SETPIPE_SZ, in_size);
+    char buffer [65536];
+    bool ok = true;
+    int i;
+    
+    while (ok) {
+        ssize_t n;
+        if (use_tee) {
+            n = tee(in_fd, out_fd, 1 << 20, 0);
+            if (n < 0 && errno == EINVAL) { // not a pair of pipes
+                use_tee = false;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ok = false;
+            if (n <= 0) break;
+            
+            bool consumed = false;
+            for (i = 0; ok && !consumed && i < num_files - 1; i++) {
+                // tee again from the unconsumed input, then drain the scratch pipe into the file
+                ssize_t copied;
+                do {
+                    copied = tee(in_fd, scratch[1], n, 0);
+                } while (copied < 0 && errno == EINTR);
+                ok = copied >= 0 && splice_all(scratch[0], files[i], copied);
+                if (ok && copied < n) {
+                    ok = write_chunk(in_fd, n, copied, files + i, num_files - i);
+                    consumed = true;
+                }
+            }
+            if (ok && !consumed) ok = splice_all(in_fd, files[num_files - 1], n);
+        } else {
+            n = read(in_fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ok = false;
+            if (n <= 0) break;
+            ok = write_all(out_fd, buffer, n);
+            for (i = 0; ok && i < num_files; i++) ok = write_all(files[i], buffer, n);
+        }
+    }
+    if (scratch[0] >= 0) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    return ok;
+}
+
+// moves exactly len bytes from a pipe to a file
+bool splice_all(int in_fd, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t moved = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) return false;
+        len -= moved;
+    }
+    return true;
+}
+
+/* a chunk of len bytes that tee could only partly duplicate. It is read out
+ * of the pipe; the first file gets what it lacks after done bytes, the
+ * others get all of it */
+bool write_chunk(int in_fd, size_t len, size_t done, int* files, int num_files) {
+    char* chunk = malloc(len);
+    size_t got = 0;
+    while (chunk != NULL && got < len) {
+        ssize_t n = read(in_fd, chunk + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    bool ok = chunk != NULL && got == len && write_all(files[0], chunk + done, len - done);
+    int i;
+    for (i = 1; ok && i < num_files; i++) ok = write_all(files[i], chunk, len);
+    free(chunk);
+    return ok;
+}
+
+/* copies in_fd to out_fd until end of file, keeping the data in the kernel
+ * where it can: copy_file_range between regular files (a reflink or a server
+ * side copy on file systems that have them), sendfile from a regular file to
+ * anything else, and relay_fd for the rest. Files that report no size, like
+ * those in /proc, are read normally since copy_file_range sees them as empty */
+bool copy_fd(int in_fd, int out_fd) {
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) < 0 || !S_ISREG(in_stat.st_mode) || in_stat.st_size == 0) return relay_fd(in_fd, out_fd);
+    
+    ssize_t n;
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0);
+    if (n == 0) return true;
+    if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != EOPNOTSUPP && errno != ENOSYS) return false;
+    
+    // not file to file, or across file systems the kernel cannot copy between
+    while ((n = sendfile(out_fd, in_fd, NULL, 1 << 30)) > 0);
+    if (n == 0) return true;
+    if (errno != EINVAL && errno != ENOSYS) return false;
+    return relay_fd(in_fd, out_fd); // an O_APPEND target, say
+}
+
+/* hands out 16 byte aligned memory from the newest block, adding a block
+ * when it is full */
+void* arena_alloc(arena* a, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    arena_block* block = a->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block*) malloc(sizeof(arena_block) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = a->blocks;
+        a->blocks = block;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    a->total += size;
+    return memory;
+}
+
+// grows the latest allocation in place when it is at the end of its block
+void* arena_grow(arena* a, void* old, size_t old_size, size_t new_size) {
+    arena_block* block = a->blocks;
+    old_size = (old_size + 15) & ~(size_t) 15;
+    if (block != NULL && (char*) old + old_size == block->data + block->used
+            && block->used - old_size + new_size <= block->size) {
+        new_size = (new_size + 15) & ~(size_t) 15;
+        block->used += new_size - old_size;
+        a->total += new_size - old_size;
+        return old;
+    }
+    void* memory = arena_alloc(a, new_size);
+    memcpy(memory, old, old_size);
+    return memory;
+}
+
+/* forgets everything handed out. If the line needed more than one block they
+ * are replaced by a single block big enough for all of it, so the next line
+ * of the same size needs no malloc */
+void arena_reset(arena* a) {
+    if (a->blocks != NULL && a->blocks->next != NULL) {
+        size_t total = a->total;
+        arena_free(a);
+        arena_alloc(a, total);
+    }
+    if (a->blocks != NULL) a->blocks->used = 0;
+    a->total = 0;
+}
+
+void arena_free(arena* a) {
+    while (a->blocks != NULL) {
+        arena_block* tmp = a->blocks;
+        a->blocks = tmp->next;
+        free(tmp);
+    }
+    a->total = 0;
+}
+
+arena* arena_create() {
+    return (arena*) calloc(1, sizeof(arena));
+}
+
+void arena_destroy(arena* a) {
+    arena_free(a);
+    free(a);
+}
+
+void free_path(path* head) {
+    while (head != NULL) {
+        path* tmp = head;
+        head = head->next;
+        free(tmp);
+    }
+}
+
+int run_builtin(char** params, path* head, program_state** p_state) {
+    builtin* command = find_builtin(params[0]);
+    if (command == NULL) return 127;
+    int status = command->run(params, head, p_state);
+    fflush(stdout);
+    return status;
+}
+
+/* builtins run in the shell itself, so a redirection is put on the shell's own
+ * 0, 1 and 2 for as long as the builtin runs and then undone */
+int run_redirected_builtin(char** params, redirect* io, path* head, program_state** p_state) {
+    if (!redirected(io, 0) && !redirected(io, 1) && !redirected(io, 2)) return run_builtin(params, head, p_state);
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int saved[3] = {-1, -1, -1};
+    int order [3], i;
+    if (!open_redirects(io, fds)) return 1;
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        if (redirected(io, i)) saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+    stdio_order(fds, order);
+    for (i = 0; i < 3; i++) {
+        if (redirected(io, order[i])) dup2(fds[order[i]], order[i]);
+    }
+    close_redirects(io, fds);
+    
+    int status = run_builtin(params, head, p_state);
+    
+    fflush(stderr);
+    for (i = 0; i < 3; i++) {
+        if (saved[i] < 0) continue;
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    return status;
+}
+
+/* writes each file in turn to stdout without reading it into the shell:
+ * copy_file_range when stdout is a file, sendfile otherwise. - or no file
+ * reads stdin */
+int builtin_cat(char** params, path* head, program_state** p_state) {
+    char* stdin_only [] = {"cat", "-", NULL};
+    if (params[1] == NULL) params = stdin_only;
+    int i, status = 0;
+    fflush(stdout);
+    for (i = 1; params[i] != NULL; i++) {
+        bool from_stdin = strcmp(params[i], "-") == 0;
+        int fd = from_stdin ? STDIN_FILENO : open(params[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s.\n", params[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (!copy_fd(fd, STDOUT_FILENO)) {
+            fprintf(stderr, "cat: %s: %s.\n", params[i], strerror(errno));
+            status = 1;
+        }
+        if (!from_stdin) close(fd);
+    }
+    return status;
+}
+
+int builtin_cd(char** params, path* head, program_state** p_state) {
+    change_directory(params[1]);
+    drop_queue_context(); // jobs already queued still start in the old directory
+    return 0;
+}
+
+int builtin_echo(char** params, path* head, program_state** p_state) {
+    int i = 1;
+    bool newline = true;
+    if (params[1] != NULL && strcmp(params[1], "-n") == 0) {
+        newline = false;
+        i++;
+    }
+    for (; params[i] != NULL; i++) {
+        fputs(params[i], stdout);
+        if (params[i + 1] != NULL) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+int builtin_exit(char** params, path* head, program_state** p_state) {
+    if (_inc_jobs(0) > 0 || queue_depth > 0) {
+        printf("You cannot exit while there are processes running.\n");
+        return 1;
+    }
+    (*p_state)->do_exit = true;
+    return params[1] != NULL ? strtol(params[1], NULL, 10) & 0xff : 0;
+}
+
+int builtin_help(char** params, path* head, program_state** p_state) {
+    if (params[1] != NULL) {
+        builtin* command = find_builtin(params[1]);
+        if (command == NULL) {
+            printf("help: no builtin named %s.\n", params[1]);
+            return 1;
+        }
+        printf("%s\n", command->help);
+        return 0;
+    }
+    int i;
+    for (i = 0; i < NUM_BUILTINS; i++) printf("%s\n", builtins[i].help);
+    return 0;
+}
+
+/* the kept lines run back to back in the mapping, so a substring search is
+ * one memmem over all of them and each match is turned back into an entry
+ * with a binary search on the offsets */
+int builtin_history(char** params, path* head, program_state** p_state) {
+    history* h = &shell_history;
+    long i;
+    if (params[1] != NULL && (strcmp(params[1], "-s") == 0 || strcmp(params[1], "-p") == 0)) {
+        if (params[2] == NULL) {
+            printf("history: %s needs an argument.\n", params[1]);
+            return 1;
+        }
+        size_t len = strlen(params[2]);
+        if (params[1][1] == 'p') {
+            for (i = 0; i < h->count; i++) {
+                history_entry* entry = history_at(i);
+                if (entry->len >= len && memcmp(history_text(entry), params[2], len) == 0) print_history_entry(i);
+            }
+            return 0;
+        }
+        if (h->count == 0 || len == 0) return 0;
+        char* data = h->map + sizeof(history_header);
+        size_t offset = history_at(0)->offset, end = history_head()->used;
+        char* match;
+        while (offset < end && (match = memmem(data + offset, end - offset, params[2], len)) != NULL) {
+            long index = find_history_offset(match - data);
+            print_history_entry(index);
+            history_entry* entry = history_at(index);
+            offset = entry->offset + entry->len + 1; // one line per entry however often it matches
+        }
+        return 0;
+    }
+    
+    long shown = h->count;
+    if (params[1] != NULL) {
+        shown = strtol(params[1], NULL, 10);
+        if (shown <= 0) {
+            printf("history: %s is not a count.\n", params[1]);
+            return 1;
+        }
+        if (shown > h->count) shown = h->count;
+    }
+    for (i = h->count - shown; i < h->count; i++) print_history_entry(i);
+    return 0;
+}
+
+int builtin_jobs(char** params, path* head, program_state** p_state) {
+    bool verbose = params[1] != NULL && strcmp(params[1], "-v") == 0;
+    if (verbose) {
+        // finished commands first so the running ones stay next to the prompt
+        long i = num_finished > FINISHED_JOBS ? num_finished - FINISHED_JOBS : 0;
+        for (; i < num_finished; i++) print_job_record(&finished_jobs[i % FINISHED_JOBS]);
+    }
+    print_processes(head_jobs);
+    if (verbose) {
+        processes* current;
+        for (current = head_jobs->next; current != NULL; current = current->next) {
+            double user = 0, sys = 0;
+            long rss = 0;
+            read_proc_usage(current->id, &user, &sys, &rss);
+            printf("[%d]: real %.3fs user %.3fs sys %.3fs rss %ld KB so far\n",
+                   current->id, seconds_since(&current->started), user, sys, rss);
+        }
+    }
+    print_queue();
+    printf("%d running, %d queued, at most %d at once.\n", _inc_jobs(0), queue_depth, (*p_state)->max_jobs);
+    return 0;
+}
+
+/* limit [options]: with a command the limits are for that command only and
+ * execute_command handles them, so here they are for every later command */
+int builtin_limit(char** params, path* head, program_state** p_state) {
+    char limits [160];
+    if (params[1] == NULL) {
+        describe_limits(&(*p_state)->limits, limits, sizeof(limits));
+        printf("Commands are limited to %s.\n", limits);
+        return 0;
+    }
+    job_limits changed = (*p_state)->limits;
+    int end = parse_limits(params, &changed);
+    if (end < 0) return 1;
+    if (params[end] != NULL) {
+        printf("limit: %s runs inside the shell and can't be limited.\n", params[end]);
+        return 1;
+    }
+    (*p_state)->limits = changed;
+    return 0;
+}
+
+/* mode [parallel|sequential] [max jobs] */
+int builtin_mode(char** params, path* head, program_state** p_state) {
+    (*p_state)->in_parallel = change_mode(params[1], p_state);
+    if (params[1] != NULL && params[2] != NULL) {
+        int max_jobs = strtol(params[2], NULL, 10);
+        if (max_jobs < 1) {
+            printf("The number of parallel jobs must be at least 1.\n");
+            return 1;
+        }
+        (*p_state)->max_jobs = max_jobs;
+    }
+    if (params[1] == NULL && (*p_state)->mode == PARALLEL)
+        printf("At most %d jobs run at once%s.\n", (*p_state)->max_jobs, (*p_state)->pin_cpus ? ", each pinned to a cpu" : "");
+    return 0;
+}
+
+int builtin_output(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        char* names [] = {"direct", "line", "group"};
+        printf("Parallel jobs write their output %s.\n", names[output_mode]);
+        return 0;
+    }
+    if (!set_output_mode(params[1])) {
+        printf("output takes direct, line or group.\n");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_pause(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        printf("pause takes in the process ID as an argument.\n");
+        return 1;
+    }
+    pause_process(params[1]);
+    return 0;
+}
+
+int builtin_pipesize(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        if (pipe_buffer_size == 0) printf("Pipes use the kernel's default size.\n");
+        else printf("Pipes are %d bytes.\n", pipe_buffer_size);
+        return 0;
+    }
+    int size = strtol(params[1], NULL, 10);
+    if (size < 0) {
+        printf("pipesize takes a positive number of bytes, or 0 for the default.\n");
+        return 1;
+    }
+    pipe_buffer_size = size;
+    if (size == 0) return 0;
+    
+    // the kernel rounds the size up and refuses sizes above /proc/sys/fs/pipe-max-size, so check now
+    int pipefd[2];
+    if (make_pipe(pipefd) < 0) {
+        printf("pipesize: %d bytes is not allowed: %s.\n", size, strerror(errno));
+        pipe_buffer_size = 0;
+        return 1;
+    }
+    pipe_buffer_size = fcntl(pipefd[0], F_GETPIPE_SZ);
+    printf("Pipes are %d bytes.\n", pipe_buffer_size);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return 0;
+}
+
+int builtin_pwd(char** params, path* head, program_state** p_state) {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd() error");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+int builtin_resume(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        printf("resume takes in the process ID as an argument.\n");
+        return 1;
+    }
+    resume_process(params[1]);
+    return 0;
+}
+
+/* copies stdin to stdout and every file given. Inside a pipeline both ends are
+ * pipes so the data is duplicated with tee(2) and moved with splice(2)
+ * without passing through the shell's memory */
+int builtin_tee(char** params, path* head, program_state** p_state) {
+    int num_files, i, status = 0;
+    for (num_files = 0; params[num_files + 1] != NULL; num_files++);
+    int* files = calloc(num_files + 1, sizeof(int));
+    
+    int opened = 0;
+    for (i = 0; i < num_files; i++) {
+        int fd = open(params[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            printf("tee: %s: %s.\n", params[i + 1], strerror(errno));
+            status = 1;
+            continue;
+        }
+        files[opened++] = fd;
+    }
+    fflush(stdout);
+    
+    bool ok = opened == 0 ? relay_fd(STDIN_FILENO, STDOUT_FILENO) : tee_fd(STDIN_FILENO, STDOUT_FILENO, files, opened);
+    if (!ok) status = 1;
+    for (i = 0; i < opened; i++) close(files[i]);
+    free(files);
+    return status;
+}
+
+int builtin_stats(char** params, path* head, program_state** p_state) {
+    if (params[1] != NULL && strcmp(params[1], "-r") == 0) {
+        memset(phase_stats, 0, sizeof(phase_stats));
+        return 0;
+    }
+    if (params[1] != NULL && strcmp(params[1], "-j") == 0) {
+        write_stats(stdout);
+        return 0;
+    }
+    int i;
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (i = 0; i < NUM_PHASES; i++) {
+        histogram* h = &phase_stats[i];
+        printf("%-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], (unsigned long) h->count,
+               h->count > 0 ? h->total_ns / 1e3 / h->count : 0.0, histogram_percentile(h, 0.5) / 1e3,
+               histogram_percentile(h, 0.9) / 1e3, histogram_percentile(h, 0.99) / 1e3, h->max_ns / 1e3);
+    }
+    return 0;
+}
+
+/* runs the rest of the line as a command in the foreground, even in parallel
+ * mode, and reports what wait4 said that one child used */
+int builtin_time(char** params, path* head, program_state** p_state) {
+    if (params[1] == NULL) {
+        printf("time takes in a command to run.\n");
+        return 1;
+    }
+    struct timespec start;
+    int mode = (*p_state)->mode;
+    memset(&last_job, 0, sizeof(last_job));
+    (*p_state)->mode = SEQUENTIAL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    int status = execute_command(&params[1], NULL, params[1], head, p_state);
+    
+    double real = seconds_since(&start);
+    (*p_state)->mode = mode;
+    double user = last_job.usage.ru_utime.tv_sec + last_job.usage.ru_utime.tv_usec / 1e6;
+    double sys = last_job.usage.ru_stime.tv_sec + last_job.usage.ru_stime.tv_usec / 1e6;
+    printf("\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+           (int) real / 60, real - 60 * ((int) real / 60),
+           (int) user / 60, user - 60 * ((int) user / 60),
+           (int) sys / 60, sys - 60 * ((int) sys / 60));
+    printf("maxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+           last_job.usage.ru_maxrss, last_job.usage.ru_nvcsw, last_job.usage.ru_nivcsw);
+    return status;
+}
+
+/* wait blocks until every job has finished, queued ones included. With pids
+ * it waits for those and returns the last one's status; -n returns as soon as
+ * one of them, or of all running jobs, finishes, with that job's status */
+int builtin_wait(char** params, path* head, program_state** p_state) {
+    bool any = params[1] != NULL && strcmp(params[1], "-n") == 0;
+    char** args = any ? &params[2] : &params[1];
+    if (!any && args[0] == NULL) {
+        wait_for_jobs(head, p_state);
+        return 0;
+    }
+    
+    int count = 0, i;
+    processes* job;
+    for (i = 0; args[i] != NULL; i++) count++;
+    if (count == 0) { // wait -n on its own takes any running job
+        for (job = head_jobs->next; job != NULL; job = job->next) count += job->reports_status;
+        if (count == 0) return 127;
+    }
+    waiter* waiters = (waiter*) calloc(count, sizeof(waiter));
+    job = head_jobs->next;
+    for (i = 0; i < count; i++) {
+        if (args[0] != NULL) {
+            waiters[i].pid = strtol(args[i], NULL, 10);
+            continue;
+        }
+        while (!job->reports_status) job = job->next;
+        waiters[i].pid = job->id;
+        job = job->next;
+    }
+    int status = await_jobs(waiters, count, any, head, p_state);
+    free(waiters);
+    return status;
+}
+
+int builtin_unset(char** params, path* head, program_state** p_state) {
+    int i;
+    for (i = 1; params[i] != NULL; i++) {
+        unset_variable(params[i]);
+        if (strcmp(params[i], "PATH") == 0) reload_path(head);
+    }
+    return 0;
+}
+
+int builtin_type(char** params, path* head, program_state** p_state) {
+    int i, status = 0;
+    for (i = 1; params[i] != NULL; i++) {
+        char* full_path;
+        if (is_built_in_command(params[i])) {
+            printf("%s is a shell builtin\n", params[i]);
+        } else if ((full_path = is_valid_command(params[i], head)) != NULL) {
+            printf("%s is %s\n", params[i], full_path);
+            free(full_path);
+        } else {
+            printf("type: %s: not found\n", params[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* maps ~/.shelby_history and indexes the lines the ring keeps, walking back
+ * from the end of the file. Only one shell writes the file at a time; if it
+ * is locked, or not a history file, the history is kept in memory instead */
+void init_history() {
+    history* h = &shell_history;
+    memset(h, 0, sizeof(history));
+    h->fd = -1;
+    h->ring = (history_entry*) calloc(HISTORY_SIZE, sizeof(history_entry));
+    if (h->ring == NULL) return;
+    
+    char* home = get_variable("HOME");
+    if (home != NULL) {
+        char file [1024];
+        snprintf(file, sizeof(file), "%s/%s", home, HISTORY_FILE);
+        h->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (h->fd >= 0 && flock(h->fd, LOCK_EX | LOCK_NB) < 0) {
+            close(h->fd);
+            h->fd = -1;
+        }
+    }
+    
+    struct stat statresult;
+    if (h->fd >= 0 && fstat(h->fd, &statresult) == 0 && statresult.st_size > 0) {
+        h->map_size = statresult.st_size;
+        h->map = mmap(NULL, h->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+        if (h->map == MAP_FAILED || h->map_size < sizeof(history_header)
+                || memcmp(h->map, HISTORY_MAGIC, sizeof(((history_header*) 0)->magic)) != 0) {
+            if (h->map != MAP_FAILED) munmap(h->map, h->map_size);
+            h->map = NULL;
+            close(h->fd); // someone else's file, leave it alone
+            h->fd = -1;
+        }
+    }
+    if (h->map == NULL) {
+        h->map_size = HISTORY_GROW;
+        if (h->fd >= 0 && ftruncate(h->fd, h->map_size) == 0)
+            h->map = mmap(NULL, h->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+        else h->map = mmap(NULL, h->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (h->map == MAP_FAILED) {
+            h->map = NULL;
+            return;
+        }
+        memcpy(history_head()->magic, HISTORY_MAGIC, sizeof(history_head()->magic));
+    }
+    
+    // a write cut short leaves used behind the data, never ahead of it
+    if (history_head()->used > h->map_size - sizeof(history_header))
+        history_head()->used = h->map_size - sizeof(history_header);
+    index_history();
+}
+
+void index_history() {
+    history* h = &shell_history;
+    char* data = h->map + sizeof(history_header);
+    size_t end = history_head()->used;
+    long kept = 0;
+    while (end > 0 && kept < HISTORY_SIZE) {
+        char* newline = end > 1 ? memrchr(data, '\n', end - 1) : NULL;
+        size_t start = newline != NULL ? (size_t) (newline - data) + 1 : 0;
+        if (h->bytes + (end - start) > HISTORY_BYTES) break;
+        h->bytes += end - start;
+        kept++;
+        end = start;
+    }
+    
+    // now fill the ring oldest first
+    size_t offset = end;
+    for (h->count = 0; h->count < kept; h->count++) {
+        char* newline = memchr(data + offset, '\n', history_head()->used - offset);
+        h->ring[h->count].offset = offset;
+        h->ring[h->count].len = newline != NULL ? (size_t) (newline - data) - offset : history_head()->used - offset;
+        offset += h->ring[h->count].len + 1;
+    }
+    
+    // drop what the ring no longer covers from a file that has grown too big
+    if (h->fd >= 0 && history_head()->used > HISTORY_FILE_MAX) {
+        size_t used = history_head()->used - end;
+        long i;
+        memmove(data, data + end, used);
+        for (i = 0; i < h->count; i++) h->ring[i].offset -= end;
+        history_head()->used = used;
+        size_t size = (sizeof(history_header) + used + HISTORY_GROW) / HISTORY_GROW * HISTORY_GROW;
+        char* map = mremap(h->map, h->map_size, size, MREMAP_MAYMOVE);
+        if (map != MAP_FAILED && ftruncate(h->fd, size) == 0) {
+            h->map = map;
+            h->map_size = size;
+        } else if (map != MAP_FAILED) h->map = map;
+    }
+}
+
+void free_history() {
+    history* h = &shell_history;
+    if (h->map != NULL) munmap(h->map, h->map_size);
+    if (h->fd >= 0) close(h->fd); // drops the lock too
+    free(h->ring);
+    memset(h, 0, sizeof(history));
+    h->fd = -1;
+}
+
+/* appends a non-empty line to the file and to the ring. The text is written
+ * before the header is updated so a crash never leaves a half line counted */
+void add_history(char* command) {
+    history* h = &shell_history;
+    if (h->map == NULL || strspn(command, " \t\r\n") == strlen(command)) return;
+    size_t len = strlen(command);
+    if (!grow_history(sizeof(history_header) + history_head()->used + len + 1)) return;
+    
+    char* data = h->map + sizeof(history_header);
+    size_t offset = history_head()->used;
+    memcpy(data + offset, command, len);
+    data[offset + len] = '\n';
+    
+    while (h->count > 0 && (h->count == HISTORY_SIZE || h->bytes + len + 1 > HISTORY_BYTES)) {
+        h->bytes -= h->ring[h->first].len + 1;
+        h->first = (h->first + 1) % HISTORY_SIZE;
+        h->count--;
+    }
+    history_entry* entry = &h->ring[(h->first + h->count) % HISTORY_SIZE];
+    entry->offset = offset;
+    entry->len = len;
+    h->count++;
+    h->bytes += len + 1;
+    history_head()->used += len + 1;
+    history_head()->count++;
+}
+
+// makes the file and the mapping at least size bytes, they may move
+bool grow_history(size_t size) {
+    history* h = &shell_history;
+    if (size <= h->map_size) return true;
+    size = (size + HISTORY_GROW - 1) / HISTORY_GROW * HISTORY_GROW;
+    if (h->fd >= 0 && ftruncate(h->fd, size) < 0) return false;
+    char* map = mremap(h->map, h->map_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) return false;
+    h->map = map;
+    h->map_size = size;
+    return true;
+}
+
+history_header* history_head() {
+    return (history_header*) shell_history.map;
+}
+
+// entries are not NUL terminated, use the length
+char* history_text(history_entry* entry) {
+    return shell_history.map + sizeof(history_header) + entry->offset;
+}
+
+// index 0 is the oldest entry in the ring
+history_entry* history_at(long index) {
+    return &shell_history.ring[(shell_history.first + index) % HISTORY_SIZE];
+}
+
+long history_number(long index) {
+    return history_head()->count - shell_history.count + 1 + index;
+}
+
+// NULL once the line has left the ring
+history_entry* find_history(long number) {
+    if (shell_history.count == 0) return NULL;
+    long index = number - history_number(0);
+    if (index < 0 || index >= shell_history.count) return NULL;
+    return history_at(index);
+}
+
+// newest line starting with prefix
+history_entry* find_history_prefix(char* prefix, size_t len) {
+    long i;
+    for (i = shell_history.count - 1; i >= 0; i--) {
+        history_entry* entry = history_at(i);
+        if (entry->len >= len && memcmp(history_text(entry), prefix, len) == 0) return entry;
+    }
+    return NULL;
+}
+
+// index of the entry holding the byte at offset, offsets grow through the ring
+long find_history_offset(size_t offset) {
+    long low = 0, high = shell_history.count - 1;
+    while (low < high) {
+        long mid = (low + high + 1) / 2;
+        if (history_at(mid)->offset <= offset) low = mid;
+        else high = mid - 1;
+    }
+    return low;
+}
+
+/* replaces !!, !n, !-n and !prefix with earlier lines everywhere except in
+ * single quotes. A ! before a blank or = stays as it is. Returns the line
+ * itself when there is nothing to expand, or NULL after printing a message
+ * when an event is not in the history */
+char* expand_history(arena* a, char* line) {
+    if (strchr(line, '!') == NULL || shell_history.map == NULL) return line;
+    size_t size = strlen(line) + 1, used = 0;
+    char* out = arena_alloc(a, size);
+    char quote = '\0';
+    char* src = line;
+    bool substituted = false;
+    while (*src != '\0') {
+        char* text = src;
+        size_t len = 1;
+        char* next = src + 1;
+        if (*src == '\\' && quote != '\'' && src[1] != '\0') {
+            len = 2;
+            next = src + 2;
+        } else if (*src == '!' && quote != '\'' && src[1] != '\0' && strchr(HISTORY_LITERAL, src[1]) == NULL) {
+            history_entry* event;
+            if (src[1] == '!') {
+                event = find_history(history_head()->count);
+                next = src + 2;
+            } else if (isdigit((unsigned char) src[1]) || (src[1] == '-' && isdigit((unsigned char) src[2]))) {
+                long number = strtol(src + 1, &next, 10);
+                event = find_history(number < 0 ? (long) history_head()->count + 1 + number : number);
+            } else {
+                next = src + 1 + strcspn(src + 1, HISTORY_LITERAL);
+                event = find_history_prefix(src + 1, next - src - 1);
+            }
+            if (event == NULL) {
+                printf("%.*s: event not found.\n", (int) (next - src), src);
+                return NULL;
+            }
+            text = history_text(event);
+            len = event->len;
+            substituted = true;
+        } else if (quote != '\0' && *src == quote) {
+            quote = '\0';
+        } else if (quote == '\0' && (*src == '\'' || *src == '"')) {
+            quote = *src;
+        }
+        
+        if (used + len + 1 > size) {
+            out = arena_grow(a, out, size, (used + len + 1) * 2);
+            size = (used + len + 1) * 2;
+        }
+        memcpy(out + used, text, len);
+        used += len;
+        src = next;
+    }
+    out[used] = '\0';
+    return substituted ? out : line; // run_line echoes the line only when it changed
+}
+
+void print_history_entry(long index) {
+    history_entry* entry = history_at(index);
+    printf("%5ld  %.*s\n", history_number(index), (int) entry->len, history_text(entry));
+}
+
+void pause_process(char* id) {
+    pid_t pid = strtol(id, NULL, 10);  
+    if (pid == 0) {
+        printf("Invalid process id.\n");
+        return;
+    }
+    if (kill(pid, SIGSTOP) == 0)
+        set_process_state(pid, PAUSED);
+}
+
+void resume_process(char* id) {
+    pid_t pid = strtol(id, NULL, 10);
+    if (pid == 0) {
+        printf("Invalid process id.\n");
+        return;
+    }
+    if (kill(pid, SIGCONT) == 0) {
+        set_process_state(pid, RUNNING);
+    }
+}
+
+
+void print_path(path* head, int num_words) {
+    path* current = head;
+    int i;
+    for (i = 0; i < num_words; i++) {
+        printf("%s ", current->path_var);
+        current = current->next;
+    }
+    printf("\n");
+    return;
+}
+
+/* reads $PATH from the shell's variables instead of asking a shell to echo it */
+path* load_environment() {
+    char* path_env = get_variable("PATH");
+    if (path_env == NULL || path_env[0] == '\0')
+        path_env = "/usr/local/bin:/usr/bin:/bin"; // same fallback as most shells
+    
+    char** environment = tokenify(path_env, ":");
+    path* head = load_path_from_list(environment);
+    free_tokens(environment);
+    return head;
+}
+
+void set_process_state (pid_t pid, state process_state) {
+    processes* current = find_process(pid);
+    
+    if (current == NULL) {
+        printf("Could not find the job with id: %d.\n", pid);
+        return;
+    }
+    
+    processes** tmp = &current;
+    if (process_state == PAUSED) {
+        printf("Job %d paused.\n", pid);
+        (*tmp)->process_state = PAUSED;
+        return;
+    }
+        
+    if (process_state == RUNNING) {
+        printf("Job %d resumed.\n", pid);
+        (*tmp)->process_state = RUNNING;
+        return;
+    }
+    
+    return;
+}
+
+processes* find_process(pid_t pid) {
+    processes* current = job_index[pid % JOB_INDEX_SIZE];
+    while (current != NULL && current->id != pid) {
+        current = current->next_in_bucket;
+    }
+    return current;
+}
+
+processes* add_process(pid_t pid, char* process_name) {
+    processes* job = (processes*) calloc(1, sizeof(processes));
+    job->id = pid;
+    strncpy(job->prc_name, process_name, sizeof(job->prc_name) - 1);
+    job->process_state = RUNNING;
+    job->journal_id = current_journal_id;
+    job->reply_fd = reply_fd;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    
+    job->previous = tail_jobs;
+    tail_jobs->next = job;
+    tail_jobs = job;
+    
+    job->next_in_bucket = job_index[pid % JOB_INDEX_SIZE];
+    job_index[pid % JOB_INDEX_SIZE] = job;
+    _inc_jobs(1);
+    return job;
+}
+
+void delete_process(pid_t process_id) {
+    processes** link = &job_index[process_id % JOB_INDEX_SIZE];
+    while (*link != NULL && (*link)->id != process_id) {
+        link = &(*link)->next_in_bucket;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    
+    processes* tmp = *link;
+    *link = tmp->next_in_bucket;
+    tmp->previous->next = tmp->next;
+    if (tmp->next != NULL) tmp->next->previous = tmp->previous;
+    else tail_jobs = tmp->previous;
+    _inc_jobs(-1);
+    free(tmp);
+    return;
+}
+
+void print_processes(processes* head) {
+    processes* current = head_jobs->next;
+
+    while(current != NULL) {
+        char p_state [32] = "";
+        if (current->process_state == PAUSED) {
+            strcpy(p_state, "PAUSED");
+        } else if (current->process_state == DEAD) {
+            strcpy(p_state, "DEAD"); // plan to keep a list of active and inactive processes
+        } else {
+            strcpy(p_state, "RUNNING");
+        }
+        
+        printf("[%d]: %s - STATUS: %s\n", current->id, current->prc_name, p_state);
+        if (limits_active(&current->limits)) {
+            char limits [160];
+            describe_limits(&current->limits, limits, sizeof(limits));
+            printf("[%d]: limited to %s\n", current->id, limits);
+        }
+        current = current->next;
+    }
+    return;
+}
+
+bool job_slot_free(program_state** p_state) {
+    return head_queue == NULL && _inc_jobs(0) < (*p_state)->max_jobs;
+}
+
+void enqueue_job(pipeline* command, uint64_t journal_id) {
+    queued_job* job = (queued_job*) calloc(1, sizeof(queued_job));
+    job->command = pack_pipeline(command);
+    job->context = share_queue_context();
+    job->journal_id = journal_id;
+    if (tail_queue != NULL) tail_queue->next = job;
+    else head_queue = job;
+    tail_queue = job;
+    queue_depth++;
+}
+
+/* starts queued commands while there are free slots. Called whenever jobs
+ * have been reaped. Queued commands always run as parallel jobs, even if the
+ * mode was switched back to sequential after they were queued */
+void schedule_jobs(path* head, program_state** p_state) {
+    int mode = (*p_state)->mode;
+    (*p_state)->mode = PARALLEL;
+    command_cache.checked = false; // the jobs started together share one check
+    while (head_queue != NULL && _inc_jobs(0) < (*p_state)->max_jobs) {
+        queued_job* job = head_queue;
+        head_queue = job->next;
+        if (head_queue == NULL) tail_queue = NULL;
+        queue_depth--;
+        uint64_t journal_id = current_journal_id; // a builtin such as run-dag may be starting us mid-line
+        current_journal_id = job->journal_id;
+        int cwd_fd = enter_context(job->context);
+        run_command(job->command, head, p_state);
+        leave_context(cwd_fd);
+        current_journal_id = journal_id;
+        release_context(job->context);
+        free(job->command);
+        free(job);
+    }
+    (*p_state)->mode = mode;
+}
+
+/* copies an expanded pipeline out of the line's arena into one block: the
+ * stages, then every argv, then the strings they and the redirections point to */
+pipeline* pack_pipeline(pipeline* command) {
+    size_t pointers = 0, chars = strlen(command->text) + 1;
+    int i, j, k;
+    for (i = 0; i < command->num_stages; i++) {
+        stage* current = &command->stages[i];
+        for (j = 0; current->argv[j] != NULL; j++) chars += strlen(current->argv[j]) + 1;
+        pointers += j + 1;
+        for (k = 0; k < 3; k++) {
+            if (current->io.files[k] != NULL) chars += strlen(current->io.files[k]) + 1;
+        }
+    }
+    size_t stages_size = command->num_stages * sizeof(stage);
+    char* block = malloc(sizeof(pipeline) + stages_size + pointers * sizeof(char*) + chars);
+    pipeline* copy = (pipeline*) block;
+    stage* stages = (stage*) (block + sizeof(pipeline));
+    char** argv = (char**) (block + sizeof(pipeline) + stages_size);
+    char* text = (char*) (argv + pointers);
+    
+    *copy = *command;
+    copy->stages = stages;
+    copy->deferred = false;
+    copy->text = strcpy(text, command->text);
+    text += strlen(text) + 1;
+    for (i = 0; i < command->num_stages; i++) {
+        stage* current = &command->stages[i];
+        stages[i] = *current;
+        stages[i].argv = argv;
+        for (j = 0; current->argv[j] != NULL; j++) {
+            *argv++ = strcpy(text, current->argv[j]);
+            text += strlen(text) + 1;
+        }
+        *argv++ = NULL;
+        for (k = 0; k < 3; k++) {
+            if (current->io.files[k] == NULL) continue;
+            stages[i].io.files[k] = strcpy(text, current->io.files[k]);
+            text += strlen(text) + 1;
+        }
+    }
+    return copy;
+}
+
+// the context for a job being queued now, opened once per working directory
+job_context* share_queue_context() {
+    if (queue_context == NULL) {
+        queue_context = (job_context*) calloc(1, sizeof(job_context));
+        queue_context->cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        queue_context->envp = copy_environment(exec_environment());
+        queue_context->refs = 1; // the queue's own, until the next cd
+    }
+    queue_context->refs++;
+    return queue_context;
+}
+
+// cd or an export was run, jobs queued from now on need a context of their own
+void drop_queue_context() {
+    if (queue_context != NULL) release_context(queue_context);
+    queue_context = NULL;
+}
+
+char** copy_environment(char** envp) {
+    size_t count = 0, chars = 0;
+    for (; envp[count] != NULL; count++) chars += strlen(envp[count]) + 1;
+    char** copy = malloc((count + 1) * sizeof(char*) + chars);
+    char* text = (char*) (copy + count + 1);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        copy[i] = strcpy(text, envp[i]);
+        text += strlen(text) + 1;
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+void release_context(job_context* context) {
+    if (--context->refs > 0) return;
+    if (context->cwd_fd >= 0) close(context->cwd_fd);
+    free(context->envp);
+    free(context);
+}
+
+/* moves into the directory a job was queued in and hands exec its variables.
+ * Returns the directory to go back to afterwards, or -1 when the shell is
+ * still where it was */
+int enter_context(job_context* context) {
+    running_context = context;
+    if (context == queue_context || context->cwd_fd < 0) return -1;
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd >= 0 && fchdir(context->cwd_fd) < 0) {
+        close(cwd_fd);
+        return -1;
+    }
+    return cwd_fd;
+}
+
+void leave_context(int cwd_fd) {
+    running_context = NULL;
+    if (cwd_fd < 0) return;
+    if (fchdir(cwd_fd) < 0) perror("fchdir");
+    close(cwd_fd);
+}
+
+// pins a new job to the next cpu in turn. The job has already started, but only for a moment
+void place_job(pid_t pid, program_state** p_state) {
+    if (!(*p_state)->pin_cpus || (*p_state)->num_cpus == 0) return;
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET((*p_state)->cpus[(*p_state)->next_cpu++ % (*p_state)->num_cpus], &cpu);
+    sched_setaffinity(pid, sizeof(cpu), &cpu);
+}
+
+/* keeps what a finished command used: in the ring of recent commands, as
+ * the last foreground command, and among the heaviest if it is one */
+void record_job(pid_t pid, char* name, int status, struct timespec* started, struct rusage* usage, char* limit_hit) {
+    job_record record;
+    memset(&record, 0, sizeof(record));
+    record.id = pid;
+    strncpy(record.name, name, sizeof(record.name) - 1);
+    record.exit_status = status;
+    record.wall = seconds_since(started);
+    record.usage = *usage;
+    record.limit_hit = limit_hit;
+    record_phase_ns(PHASE_RUN, record.wall * 1e9); // exec to exit, as seen by the shell
+    
+    last_job = record;
+    finished_jobs[num_finished++ % FINISHED_JOBS] = record;
+    
+    double cpu = cpu_seconds(usage);
+    if (num_heaviest == HEAVIEST_JOBS && cpu <= cpu_seconds(&heaviest_jobs[HEAVIEST_JOBS - 1].usage)) return;
+    int i = num_heaviest < HEAVIEST_JOBS ? num_heaviest++ : HEAVIEST_JOBS - 1;
+    for (; i > 0 && cpu_seconds(&heaviest_jobs[i - 1].usage) < cpu; i--) heaviest_jobs[i] = heaviest_jobs[i - 1];
+    heaviest_jobs[i] = record;
+}
+
+// sums the times and switches of pipeline stages, the peak rss is the largest stage's
+void add_usage(struct rusage* total, struct rusage* part) {
+    timeradd(&total->ru_utime, &part->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &part->ru_stime, &total->ru_stime);
+    if (part->ru_maxrss > total->ru_maxrss) total->ru_maxrss = part->ru_maxrss;
+    total->ru_nvcsw += part->ru_nvcsw;
+    total->ru_nivcsw += part->ru_nivcsw;
+}
+
+double cpu_seconds(struct rusage* usage) {
+    return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec
+         + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+}
+
+double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void print_job_record(job_record* record) {
+    printf("[%d]: %s - STATUS: %d, real %.3fs user %.3fs sys %.3fs maxrss %ld KB ctxsw %ld/%ld\n",
+           record->id, record->name, record->exit_status, record->wall,
+           record->usage.ru_utime.tv_sec + record->usage.ru_utime.tv_usec / 1e6,
+           record->usage.ru_stime.tv_sec + record->usage.ru_stime.tv_usec / 1e6,
+           record->usage.ru_maxrss, record->usage.ru_nvcsw, record->usage.ru_nivcsw);
+    if (record->limit_hit != NULL) printf("[%d]: stopped by its %s limit\n", record->id, record->limit_hit);
+}
+
+/* cpu time and resident size of a job that is still running, from
+ * /proc/pid/stat. The fields after the command name are fixed, see proc(5) */
+bool read_proc_usage(pid_t pid, double* user, double* sys, long* rss) {
+    char file [64], buffer [1024];
+    snprintf(file, sizeof(file), "/proc/%d/stat", pid);
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0) return false;
+    buffer[len] = '\0';
+    
+    char* fields = strrchr(buffer, ')'); // the name may hold spaces and brackets
+    unsigned long utime, stime;
+    long pages;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                                 &utime, &stime, &pages) != 3) return false;
+    long ticks = sysconf(_SC_CLK_TCK);
+    *user = (double) utime / ticks;
+    *sys = (double) stime / ticks;
+    *rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    return true;
+}
+
+// batch mode ends with the commands that used the most cpu
+void print_heaviest_jobs() {
+    int i;
+    if (num_heaviest == 0) return;
+    fprintf(stderr, "Heaviest commands by cpu time:\n");
+    for (i = 0; i < num_heaviest; i++) {
+        job_record* record = &heaviest_jobs[i];
+        fprintf(stderr, "%8.3fs cpu %8.3fs real %8ld KB  %s\n", cpu_seconds(&record->usage), record->wall,
+                record->usage.ru_maxrss, record->name);
+    }
+}
+
+void clear_limits(job_limits* limits) {
+    memset(limits, 0, sizeof(job_limits));
+    limits->cpu = limits->address = limits->files = RLIM_INFINITY;
+}
+
+bool limits_active(job_limits* limits) {
+    return limits->cpu != RLIM_INFINITY || limits->address != RLIM_INFINITY || limits->files != RLIM_INFINITY
+        || limits->nice != 0 || limits->io_class != 0;
+}
+
+// index of the command in limit [options] command ..., 0 when it is not one
+int limited_command(char** params) {
+    if (params[0] == NULL || strcmp(params[0], "limit") != 0) return 0;
+    int i = 1;
+    while (params[i] != NULL && params[i][0] == '-' && params[i + 1] != NULL) i += 2;
+    return params[i] != NULL ? i : 0;
+}
+
+/* reads the options after limit into limits. Returns the index of the first
+ * word that is not an option, or -1 after printing what was wrong */
+int parse_limits(char** params, job_limits* limits) {
+    int i;
+    for (i = 1; params[i] != NULL && params[i][0] == '-'; i += 2) {
+        char* option = params[i];
+        char* value = params[i + 1];
+        bool valid = value != NULL && strlen(option) == 2;
+        if (!valid) {
+            printf("limit: %s needs a value.\n", option);
+            return -1;
+        }
+        if (option[1] == 't') valid = parse_rlimit(value, 1, &limits->cpu);
+        else if (option[1] == 'm') valid = parse_rlimit(value, 1 << 20, &limits->address);
+        else if (option[1] == 'n') valid = parse_rlimit(value, 1, &limits->files);
+        else if (option[1] == 'i') valid = parse_io_priority(value, limits);
+        else if (option[1] == 'N') {
+            char* end;
+            long nice = strtol(value, &end, 10);
+            valid = *end == '\0' && end != value && nice >= -39 && nice <= 39;
+            if (valid) limits->nice = nice;
+        } else {
+            printf("limit: unknown option %s.\n", option);
+            return -1;
+        }
+        if (!valid) {
+            printf("limit: %s is not a valid value for %s.\n", value, option);
+            return -1;
+        }
+    }
+    return i;
+}
+
+// a positive number of units, or unlimited
+bool parse_rlimit(char* value, rlim_t scale, rlim_t* limit) {
+    if (strcmp(value, "unlimited") == 0) {
+        *limit = RLIM_INFINITY;
+        return true;
+    }
+    char* end;
+    long long n = strtoll(value, &end, 10);
+    if (*end != '\0' || end == value || n <= 0 || (rlim_t) n > RLIM_INFINITY / scale) return false;
+    *limit = n * scale;
+    return true;
+}
+
+// idle, be:level or rt:level as ionice(1) has them, or none
+bool parse_io_priority(char* value, job_limits* limits) {
+    if (strcmp(value, "none") == 0 || strcmp(value, "idle") == 0) {
+        limits->io_class = value[0] == 'i' ? IOPRIO_CLASS_IDLE : 0;
+        limits->io_level = 0;
+        return true;
+    }
+    int io_class;
+    if (strncmp(value, "be:", 3) == 0) io_class = IOPRIO_CLASS_BE;
+    else if (strncmp(value, "rt:", 3) == 0) io_class = IOPRIO_CLASS_RT;
+    else return false;
+    char* end;
+    long level = strtol(value + 3, &end, 10);
+    if (*end != '\0' || end == value + 3 || level < 0 || level > 7) return false;
+    limits->io_class = io_class;
+    limits->io_level = level;
+    return true;
+}
+
+/* the command after a limit prefix, with the prefix's limits added to
+ * limits. NULL when the prefix is wrong or the command is a builtin, which
+ * runs inside the shell */
+char** strip_limits(char** params, job_limits* limits) {
+    int skip = limited_command(params);
+    if (skip == 0) return params;
+    if (parse_limits(params, limits) < 0) return NULL;
+    if (runs_builtin(params + skip) || is_assignment(params[skip])) {
+        printf("limit: %s runs inside the shell and can't be limited.\n", params[skip]);
+        return NULL;
+    }
+    return params + skip;
+}
+
+/* in the child before exec. Only the soft limits change, so a cpu limit
+ * ends the job with SIGXCPU. Returns 0, or the errno of what failed */
+int apply_limits(job_limits* limits) {
+    int resources [] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+    rlim_t values [] = {limits->cpu, limits->address, limits->files};
+    int i;
+    for (i = 0; i < 3; i++) {
+        struct rlimit limit;
+        if (values[i] == RLIM_INFINITY) continue;
+        if (getrlimit(resources[i], &limit) < 0) return errno;
+        if (values[i] > limit.rlim_max) return EPERM;
+        limit.rlim_cur = values[i];
+        if (setrlimit(resources[i], &limit) < 0) return errno;
+    }
+    errno = 0;
+    if (limits->nice != 0 && nice(limits->nice) == -1 && errno != 0) return errno;
+    if (limits->io_class != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                                         IOPRIO_PRIO_VALUE(limits->io_class, limits->io_level)) < 0) return errno;
+    return 0;
 }
 
-bool is_built_in_command(char* command) {
-    char* builtin [] = {"exit", "pwd", "mode", "echo", "type", "resume", "pause", "jobs", "help", "history", "time", "cd", NULL};
-    int i;
-    for (i = 0; builtin[i] != NULL; i++) {
-        if (strncmp(command, builtin[i], strlen(command)) == 0) return true;
+/* which limit, if any, killed a job. Going over the cpu limit is certain from
+ * the signal; a crash with an address space limit set is most likely an
+ * allocation that the limit refused */
+char* limit_hit(int status, struct rusage* usage, job_limits* limits) {
+    if (!WIFSIGNALED(status)) return NULL;
+    int sig = WTERMSIG(status);
+    if (limits->cpu != RLIM_INFINITY && (sig == SIGXCPU || (sig == SIGKILL && cpu_seconds(usage) >= limits->cpu))) {
+        return "cpu time";
     }
-    
-    return false;
+    if (limits->address != RLIM_INFINITY && (sig == SIGSEGV || sig == SIGABRT || sig == SIGBUS)) return "address space";
+    return NULL;
 }
 
-path* list_append(char* curr, path *list) {
-    path *current = list;
-    path *newNode = (path*) calloc(1, sizeof(path));
-    if (newNode == NULL) { //case where malloc fails 
-        fprintf(stderr, "Failed to create new node to add.\n");
-        return list;
+void describe_limits(job_limits* limits, char* out, size_t size) {
+    int len = 0;
+    out[0] = '\0';
+    if (limits->cpu != RLIM_INFINITY) len += snprintf(out + len, size - len, "cpu %llus, ", (unsigned long long) limits->cpu);
+    if (limits->address != RLIM_INFINITY) len += snprintf(out + len, size - len, "address space %lluMB, ", (unsigned long long) (limits->address >> 20));
+    if (limits->files != RLIM_INFINITY) len += snprintf(out + len, size - len, "%llu files, ", (unsigned long long) limits->files);
+    if (limits->nice != 0) len += snprintf(out + len, size - len, "nice %+d, ", limits->nice);
+    if (limits->io_class == IOPRIO_CLASS_IDLE) len += snprintf(out + len, size - len, "idle io, ");
+    else if (limits->io_class != 0) len += snprintf(out + len, size - len, "%s io level %d, ",
+                                                    limits->io_class == IOPRIO_CLASS_RT ? "realtime" : "best effort", limits->io_level);
+    if (len == 0) snprintf(out, size, "nothing");
+    else out[len - 2] = '\0';
+}
+
+/* loads the commands that succeeded in earlier runs and keeps the file open
+ * for this one's. Only the id and status at the start of a line are read;
+ * lines that don't have them, like one cut short by a crash, are passed over */
+bool open_journal(char* filename) {
+    run_journal.fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (run_journal.fd < 0) {
+        fprintf(stderr, "Failed to open journal %s: %s.\n", filename, strerror(errno));
+        return false;
     }
-    strcpy(newNode->path_var, curr);
-    newNode->next = NULL;
-    
-    // adding to an empty list
-    if (list == NULL) {
-        //list = newNode; unnecessary assignement
-        return newNode;
+    struct stat statresult;
+    char* data = NULL;
+    if (fstat(run_journal.fd, &statresult) == 0 && statresult.st_size > 0) {
+        data = mmap(NULL, statresult.st_size, PROT_READ, MAP_PRIVATE, run_journal.fd, 0);
     }
-    
-    // general case
-    while (current != NULL) {
-        current = current->next;
+    size_t offset = 0, size = data != NULL && data != MAP_FAILED ? statresult.st_size : 0;
+    while (offset < size) {
+        char* newline = memchr(data + offset, '\n', size - offset);
+        size_t len = newline != NULL ? (size_t) (newline - data) - offset : size - offset;
+        char line [32], *end;
+        snprintf(line, sizeof(line), "%.*s", (int) (len < sizeof(line) - 1 ? len : sizeof(line) - 1), data + offset);
+        offset += len + 1;
+        if (newline == NULL) break; // never finished
+        uint64_t id = strtoull(line, &end, 16);
+        if (end != line + 16 || *end != ' ') continue;
+        long status = strtol(end + 1, &end, 10);
+        if (status == 0 && *end == ' ' && id != 0) {
+            journal_lookup(&run_journal.done, &run_journal.done_size, &run_journal.num_done, id, true);
+        }
     }
-    
-    current = newNode;
-    return list;
+    if (size > 0) munmap(data, size);
+    run_journal.synced_ns = now_ns();
+    return true;
 }
 
-void list_clear(path *list) {
-    while (list != NULL) {
-        path *tmp = list;
-        list = list->next;
-        free(tmp);
+void close_journal() {
+    if (run_journal.fd < 0) return;
+    if (run_journal.unsynced > 0) fdatasync(run_journal.fd);
+    close(run_journal.fd);
+    if (run_journal.skipped > 0) fprintf(stderr, "%ld commands skipped, they finished in an earlier run.\n", run_journal.skipped);
+    free(run_journal.done);
+    free(run_journal.seen);
+    memset(&run_journal, 0, sizeof(run_journal));
+    run_journal.fd = -1;
+}
+
+uint64_t fnv_hash(uint64_t hash, void* data, size_t len) {
+    unsigned char* byte = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= byte[i];
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
 }
 
-bool change_mode(char* mode_str, program_state** p_state) {
-    if (mode_str == NULL){
-        if ((*p_state)->mode == 0) {
-            printf("Running in sequential mode.\n");
-        }
-        if ((*p_state)->mode == 1) {
-            printf("Running in parallel mode.\n");
+/* finds key in a table of power of two size, inserting it when asked. The
+ * table doubles at three quarters full. NULL when the key is missing */
+journal_slot* journal_lookup(journal_slot** table, size_t* size, size_t* used, uint64_t key, bool insert) {
+    if (insert && (*used + 1) * 4 > *size * 3) {
+        size_t old_size = *size, i;
+        journal_slot* old = *table;
+        *size = old_size > 0 ? old_size * 2 : 1024;
+        *table = calloc(*size, sizeof(journal_slot));
+        *used = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].key != 0) *journal_lookup(table, size, used, old[i].key, true) = old[i];
         }
-    } else if (strcmp(mode_str, "parallel") == 0 || strcmp(mode_str, "p") == 0) {
-        return true;
-    } else if (strcmp(mode_str, "sequential") == 0 || strcmp(mode_str, "s") == 0) {
-        return false;
-    } else {
-        printf("Unrecognised mode: %s.\nValid entires are parallel or p, or sequential or s.\n", mode_str);
+        free(old);
     }
-    // default case is to return the current mode
-    return (*p_state)->in_parallel;
+    if (*size == 0) return NULL;
+    size_t slot = key & (*size - 1);
+    while ((*table)[slot].key != 0 && (*table)[slot].key != key) slot = (slot + 1) & (*size - 1);
+    if ((*table)[slot].key == 0) {
+        if (!insert) return NULL;
+        (*table)[slot].key = key;
+        (*used)++;
+    }
+    return &(*table)[slot];
 }
 
-void sig_comm() {
-    // did some work in sig_comm. The while loops approach was a bit tricky
-    int status;
-    pid_t pid = waitpid(-1, &status, WNOHANG);
-    if (pid < 0 && errno != ECHILD)
-        printf("Waitpid failed\n"); 
-    else if (pid > 0) {
-        printf("\nProcess %d finished running.\n", pid);
-        shell_printed = true;
-        show_prompt();
-        delete_process(pid);
-    }
+// the text's hash carried on over its occurrence number, never 0
+uint64_t journal_id(char* command) {
+    uint64_t text = fnv_hash(0xcbf29ce484222325ULL, command, strlen(command));
+    if (text == 0) text = 1;
+    journal_slot* seen = journal_lookup(&run_journal.seen, &run_journal.seen_size, &run_journal.num_seen, text, true);
+    uint64_t occurrence = seen->value++;
+    uint64_t id = fnv_hash(text, &occurrence, sizeof(occurrence));
+    return id != 0 ? id : 1;
 }
 
-path* load_path_from_list(char** environment) {
-    path* head = (path*) calloc(1, sizeof(path)); //calloc so the compiler doesn't complain about unitialised variables
-    
-    path* current = head;
-    int i;
-    
-    for (i = 0; environment[i] != NULL; i++) {
-        int len = strlen(environment[i]);
-        strncpy(current->path_var, environment[i], len); // copy everything but the empty space
-        current->next = (path*) calloc(1, sizeof(path));
-        current = current->next;
+bool journal_done(uint64_t id) {
+    return journal_lookup(&run_journal.done, &run_journal.done_size, &run_journal.num_done, id, false) != NULL;
+}
+
+/* builtins that set up the shell, and wait, which orders what comes after
+ * it, run again on a resumed run because later commands depend on them */
+bool reruns_on_resume(pipeline* command) {
+    static char* names [] = {"cd", "exit", "export", "hash", "limit", "mode", "output", "pipesize", "unset", "wait"};
+    char** argv = command->stages[0].argv;
+    if (command->num_stages > 1 || argv[0] == NULL || limited_command(argv) > 0) return false;
+    if (is_assignment(argv[0])) return true;
+    size_t i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(argv[0], names[i]) == 0) return true;
     }
-    current->next = NULL;  
-    
-    return head; 
+    return false;
 }
 
-path *load_path(const char *filename) {
-    FILE* file = fopen(filename, "r"); 
-    if (file == NULL) {
-        printf("Failed to open %s. Now terminating program.\n", filename);
-        exit(1);
+// one line per command: id, exit status and the text for whoever reads the file
+void journal_result(uint64_t id, int status, char* command) {
+    if (run_journal.fd < 0) return;
+    char entry [256];
+    int len = snprintf(entry, sizeof(entry), "%016llx %d %.200s\n", (unsigned long long) id, status, command);
+    if (len >= (int) sizeof(entry)) {
+        len = sizeof(entry) - 1;
+        entry[len - 1] = '\n';
     }
-    
-    path* head = (path*) calloc(1, sizeof(path*)); //calloc so the compiler doesn't complain about unitialised variables
-    
-    path* current = head;
-    
-    char current_word[256]; // a bit large so the user can add their own directories into the path
-    
-    while (fgets(current_word, 256, file) != NULL) {
-        int len = strlen(current_word);
-        strncpy(current->path_var, current_word, len - 1); // copy everything but the empty space
-        current->next = (path*) calloc(1, sizeof(path));
-        current = current->next;
+    if (!write_all(run_journal.fd, entry, len)) {
+        fprintf(stderr, "Failed to write the journal: %s.\n", strerror(errno));
+        return;
+    }
+    run_journal.unsynced++;
+    uint64_t now = now_ns();
+    if (run_journal.unsynced >= JOURNAL_SYNC_ENTRIES || now - run_journal.synced_ns >= JOURNAL_SYNC_MS * 1000000ULL) {
+        fdatasync(run_journal.fd);
+        run_journal.unsynced = 0;
+        run_journal.synced_ns = now;
     }
-    current->next = NULL;
-    
-    fclose(file);
-    return head;
 }
 
-void free_path(path* head) {
-    while (head != NULL) {
-        path* tmp = head;
-        head = head->next;
-        free(tmp);
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now); // a vdso call, no system call
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void record_phase(phase p, uint64_t start) {
+    record_phase_ns(p, now_ns() - start);
+}
+
+void record_phase_ns(phase p, uint64_t ns) {
+    histogram* h = &phase_stats[p];
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+    h->buckets[histogram_bucket(ns)]++;
+}
+
+/* the position of the top bit picks the power of two, the next HIST_SUB_BITS
+ * bits pick the bucket inside it. Small values get a bucket each */
+int histogram_bucket(uint64_t ns) {
+    if (ns < (1 << HIST_SUB_BITS)) return ns;
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// largest value that lands in a bucket
+uint64_t bucket_limit(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t mantissa = (bucket & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t histogram_percentile(histogram* h, double fraction) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t) (fraction * h->count + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return bucket_limit(i) < h->max_ns ? bucket_limit(i) : h->max_ns;
     }
+    return h->max_ns;
 }
 
-void run_builtin(char** params, char* buffer, program_state** p_state) {
-    shell_printed = false;
-    if (strcmp(params[0], "cd") == 0) {
-        change_directory(params[1]);
-    } else if (strcmp(params[0], "jobs") == 0) {
-        print_processes(head_jobs);
-    } else if (strcmp(params[0], "mode") == 0) {
-        (*p_state)->in_parallel = change_mode(params[1], p_state);
-    } else if (strcmp(params[0], "resume") == 0) {
-        if (params[1] ==  NULL) printf("resume takes in the process ID as an argument.\n");
-        else resume_process(params[1]);
-    } else if (strcmp(params[0], "pause") == 0) {
-        if (params[1] ==  NULL) printf("pause takes in the process ID as an argument.\n");
-        else pause_process(params[1]);
-    } else if (strcmp(params[0], "exit") == 0) {
-        if (_inc_jobs(0) > 0) printf("You cannot exit while there are processes running.\n");
-        else (*p_state)->do_exit = true;
-    } else {
-        run_from_system(buffer, (*p_state));
+/* one json object with a member per phase, all times in nanoseconds, and
+ * the shell's own peak memory */
+void write_stats(FILE* out) {
+    int i;
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    fprintf(out, "{\"shell\": {\"maxrss_kb\": %ld}", self.ru_maxrss);
+    for (i = 0; i < NUM_PHASES; i++) {
+        histogram* h = &phase_stats[i];
+        fprintf(out, ", \"%s\": {\"count\": %lu, \"mean_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"max_ns\": %lu}",
+                phase_names[i], (unsigned long) h->count,
+                (unsigned long) (h->count > 0 ? h->total_ns / h->count : 0),
+                (unsigned long) histogram_percentile(h, 0.5), (unsigned long) histogram_percentile(h, 0.9),
+                (unsigned long) histogram_percentile(h, 0.99), (unsigned long) h->max_ns);
     }
-    return;
+    fprintf(out, "}\n");
 }
 
-void pause_process(char* id) {
-    pid_t pid = strtol(id, NULL, 10);  
-    if (pid == 0) {
-        printf("Invalid process id.\n");
+// -S file, or -S - for stderr
+void dump_stats() {
+    if (stats_file == NULL) return;
+    FILE* out = strcmp(stats_file, "-") == 0 ? stderr : fopen(stats_file, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open %s: %s.\n", stats_file, strerror(errno));
         return;
     }
-    if (kill(pid, SIGSTOP) == 0)
-        set_process_state(pid, PAUSED);
+    write_stats(out);
+    if (out != stderr) fclose(out);
 }
 
-void resume_process(char* id) {
-    pid_t pid = strtol(id, NULL, 10);
-    if (pid == 0) {
-        printf("Invalid process id.\n");
-        return;
+bool set_output_mode(char* name) {
+    if (strcmp(name, "direct") == 0) output_mode = OUTPUT_DIRECT;
+    else if (strcmp(name, "line") == 0) output_mode = OUTPUT_LINE;
+    else if (strcmp(name, "group") == 0) output_mode = OUTPUT_GROUP;
+    else return false;
+    return true;
+}
+
+/* makes pipes for a job's stdout and stderr and puts their write ends in
+ * fds[1] and fds[2] for the job. The read ends are watched by the event loop */
+bool start_capture(int* fds) {
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) < 0) return false;
+    if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
     }
-    if (kill(pid, SIGCONT) == 0) {
-        set_process_state(pid, RUNNING);
+    capture* job = (capture*) calloc(1, sizeof(capture));
+    int read_ends [2] = {out_pipe[0], err_pipe[0]};
+    int i;
+    for (i = 0; i < 2; i++) {
+        fcntl(read_ends[i], F_SETFL, O_NONBLOCK);
+        job->streams[i].fd = read_ends[i];
+        job->streams[i].target = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+        job->streams[i].mode = output_mode;
+        job->streams[i].spill_fd = -1;
     }
+    job->next = head_captures;
+    head_captures = job;
+    num_captures++;
+    fds[1] = out_pipe[1];
+    fds[2] = err_pipe[1];
+    return true;
 }
 
-void run_from_system(char* buffer, program_state* p_state) {
-    if (p_state->mode == SEQUENTIAL) {
-        system(buffer);
-        return;
+// the job holds the write ends now, ours would keep the pipes from ever ending
+void end_capture_setup(int* fds) {
+    close(fds[1]);
+    close(fds[2]);
+}
+
+int capture_poll_fds(struct pollfd* pfd) {
+    capture* current;
+    int count = 0, i;
+    for (current = head_captures; current != NULL; current = current->next) {
+        for (i = 0; i < 2; i++) {
+            if (current->streams[i].fd < 0) continue;
+            pfd[count++] = (struct pollfd) {current->streams[i].fd, POLLIN, 0};
+        }
     }
-    
-    char* tmp = calloc(strlen(buffer) + 3, sizeof(char));
-    // add ampersand to make parallel
-    strcat(tmp, buffer);
-    strcat(tmp, " &");
-    system(tmp);
-    free(tmp);
-    shell_printed = false;
+    return count;
 }
 
-void poll_results() {
-    struct pollfd pfd[1];
-    pfd[0].fd = 0; 
-    pfd[0].events = POLLIN;
-    pfd[0].revents = 0;
-    
-    int rv = poll(&pfd[0], 1, 200);
-    if (rv < 0) printf("");
-    return;
+/* reads the streams that poll found ready, in the order capture_poll_fds
+ * listed them. A capture whose streams have both ended is written out and
+ * dropped */
+void read_captures(struct pollfd* pfd) {
+    capture** link = &head_captures;
+    int count = 0, i;
+    while (*link != NULL) {
+        capture* current = *link;
+        for (i = 0; i < 2; i++) {
+            if (current->streams[i].fd < 0) continue;
+            if (pfd[count++].revents != 0) read_stream(&current->streams[i]);
+        }
+        if (current->streams[0].fd >= 0 || current->streams[1].fd >= 0) {
+            link = &current->next;
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            flush_stream(&current->streams[i]);
+            free(current->streams[i].buffer);
+        }
+        *link = current->next;
+        free(current);
+        num_captures--;
+    }
 }
 
+// one read per wakeup so a chatty job cannot starve the rest of the loop
+void read_stream(output_stream* stream) {
+    char chunk [16384];
+    ssize_t count = read(stream->fd, chunk, sizeof(chunk));
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (count <= 0) {
+        close(stream->fd);
+        stream->fd = -1;
+        return;
+    }
+    append_stream(stream, chunk, count);
+    if (stream->mode != OUTPUT_LINE) return;
+    
+    // complete lines go out now, a partial line waits unless it is too long to hold
+    char* newline = memrchr(stream->buffer, '\n', stream->len);
+    size_t ready = newline != NULL ? (size_t) (newline - stream->buffer) + 1 : 0;
+    if (stream->len > OUTPUT_BUDGET) ready = stream->len;
+    if (ready == 0) return;
+    fflush(stream->target == STDOUT_FILENO ? stdout : stderr);
+    write_all(stream->target, stream->buffer, ready);
+    memmove(stream->buffer, stream->buffer + ready, stream->len - ready);
+    stream->len -= ready;
+}
 
-void print_path(path* head, int num_words) {
-    path* current = head;
-    int i;
-    for (i = 0; i < num_words; i++) {
-        printf("%s ", current->path_var);
-        current = current->next;
+void append_stream(output_stream* stream, char* data, size_t len) {
+    if (stream->spill_fd >= 0) {
+        write_all(stream->spill_fd, data, len);
+        return;
     }
-    printf("\n");
-    return;
+    if (stream->mode == OUTPUT_GROUP && stream->len + len > OUTPUT_BUDGET) {
+        char* dir = get_variable("TMPDIR") != NULL ? get_variable("TMPDIR") : "/tmp";
+        stream->spill_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (stream->spill_fd >= 0) {
+            write_all(stream->spill_fd, stream->buffer, stream->len);
+            write_all(stream->spill_fd, data, len);
+            stream->len = 0;
+            return;
+        }
+        // no temp file, keep it in memory rather than lose it
+    }
+    if (stream->len + len > stream->size) {
+        stream->size = (stream->len + len) * 2;
+        stream->buffer = realloc(stream->buffer, stream->size);
+    }
+    memcpy(stream->buffer + stream->len, data, len);
+    stream->len += len;
 }
 
-path* load_environment() {
-    char path_env[1024];
-    FILE *fp;
-    
-    /* Open the command for reading. */
-    fp = popen("echo $PATH", "r");
-    if (fp == NULL) {
-        printf("Failed to run command\n" );
-        exit(1);
+// writes out everything held for the stream, spilled part first
+void flush_stream(output_stream* stream) {
+    fflush(stream->target == STDOUT_FILENO ? stdout : stderr); // keep our own messages in order
+    if (stream->spill_fd >= 0) {
+        lseek(stream->spill_fd, 0, SEEK_SET);
+        relay_fd(stream->spill_fd, stream->target);
+        close(stream->spill_fd);
+        stream->spill_fd = -1;
     }
+    write_all(stream->target, stream->buffer, stream->len);
+    stream->len = 0;
+}
 
-    /* Read the output a line at a time - output it. */
-    if (fgets(path_env, sizeof(path_env)-1, fp) != NULL) {
-        printf("");
+/* every job is done: read what is left in the pipes and write it all out.
+ * Anything a job left running in the background can no longer be waited for */
+void finish_captures() {
+    while (head_captures != NULL) {
+        capture* current = head_captures;
+        int i;
+        for (i = 0; i < 2; i++) {
+            output_stream* stream = &current->streams[i];
+            while (stream->fd >= 0) {
+                char chunk [16384];
+                ssize_t count = read(stream->fd, chunk, sizeof(chunk));
+                if (count < 0 && errno == EINTR) continue;
+                if (count > 0) {
+                    append_stream(stream, chunk, count);
+                    continue;
+                }
+                // EAGAIN: something the job left behind still holds the pipe
+                close(stream->fd);
+                stream->fd = -1;
+            }
+            flush_stream(stream);
+            free(stream->buffer);
+        }
+        head_captures = current->next;
+        free(current);
+        num_captures--;
     }
+}
 
-    /* close */
-    pclose(fp);
-    char** environment = tokenify(path_env, ":");
-    path* head = load_path_from_list(environment);
-    free_tokens(environment);
-    return head;
+/* run-dag [-j n] file runs a file of steps, one per line:
+ *
+ *     name [needs ...]: command line
+ *
+ * Every step whose dependencies have succeeded runs at once, up to n at a
+ * time (the job limit by default). A failed step only stops the steps that
+ * depend on it. Returns 0 if every step succeeded */
+int builtin_run_dag(char** params, path* head, program_state** p_state) {
+    int max_jobs = (*p_state)->max_jobs;
+    char** args = &params[1];
+    if (args[0] != NULL && strcmp(args[0], "-j") == 0 && args[1] != NULL) {
+        max_jobs = strtol(args[1], NULL, 10);
+        args += 2;
+    }
+    if (args[0] == NULL || args[1] != NULL || max_jobs < 1) {
+        printf("run-dag takes a file of steps and optionally -j max jobs.\n");
+        return 1;
+    }
+    int num_steps = 0;
+    dag_step* steps = read_dag(args[0], &num_steps);
+    if (steps == NULL) return 1;
+    int status = 1;
+    if (link_dag(steps, num_steps)) status = run_dag(steps, num_steps, max_jobs, head, p_state);
+    free_dag(steps, num_steps);
+    return status;
 }
 
-void set_process_state (pid_t pid, state process_state) {
-    processes* current = head_jobs;
-    while (current != NULL && current->id != pid) {
-        current = current->next;
+/* blocks until the jobs have finished, or with any until the first of them
+ * has. Each job gets a pidfd in one epoll set, so waiting on thousands of
+ * jobs is one poll per wakeup. Jobs that already finished give the status
+ * they left in the recent job ring */
+int await_jobs(waiter* waiters, int count, bool any, path* head, program_state** p_state) {
+    wait_fd = epoll_create1(EPOLL_CLOEXEC);
+    jobs_awaited = 0;
+    last_awaited = NULL;
+    int i;
+    for (i = 0; i < count; i++) {
+        waiter* w = &waiters[i];
+        processes* job = find_process(w->pid);
+        w->pidfd = -1;
+        if (job == NULL) {
+            w->status = finished_status(w->pid);
+            w->done = true;
+            if (w->status == 127) printf("wait: %d is not a job of this shell.\n", w->pid);
+            else if (last_awaited == NULL) last_awaited = w;
+            continue;
+        }
+        job->waiter = w;
+        jobs_awaited++;
+        w->pidfd = pidfd_open(w->pid, 0);
+        struct epoll_event event = {EPOLLIN, {.ptr = w}};
+        if (w->pidfd >= 0) epoll_ctl(wait_fd, EPOLL_CTL_ADD, w->pidfd, &event);
     }
     
-    if (current == NULL) {
-        printf("Could not find the job with id: %d.\n", pid);
-        return;
+    while (jobs_awaited > 0 && !(any && last_awaited != NULL)) {
+        int events = wait_for_events(-1);
+        if (events & EVENT_WAIT) collect_awaited();
+        if (events & EVENT_CHILD) reap_children();
+        if (events & (EVENT_WAIT | EVENT_CHILD)) schedule_jobs(head, p_state);
     }
     
-    processes** tmp = &current;
-    if (process_state == PAUSED) {
-        printf("Job %d paused.\n", pid);
-        (*tmp)->process_state = PAUSED;
-        return;
-    }
-        
-    if (process_state == RUNNING) {
-        printf("Job %d resumed.\n", pid);
-        (*tmp)->process_state = RUNNING;
-        return;
+    for (i = 0; i < count; i++) {
+        if (waiters[i].pidfd >= 0) close(waiters[i].pidfd);
+        processes* job = waiters[i].done ? NULL : find_process(waiters[i].pid);
+        if (job != NULL) job->waiter = NULL;
     }
-    
-    return;
+    if (wait_fd >= 0) close(wait_fd);
+    wait_fd = -1;
+    if (any) return last_awaited != NULL ? last_awaited->status : 127;
+    return waiters[count - 1].status;
 }
 
-void add_process(pid_t pid, char* process_name) {
-    processes* current = head_jobs;
-    while(current->next != NULL) {
-        current = current->next;
+// reaps the awaited jobs whose pidfds are readable
+void collect_awaited() {
+    struct epoll_event events [64];
+    int n = epoll_wait(wait_fd, events, 64, 0), i;
+    for (i = 0; i < n; i++) {
+        waiter* w = (waiter*) events[i].data.ptr;
+        epoll_ctl(wait_fd, EPOLL_CTL_DEL, w->pidfd, NULL);
+        if (w->done) continue; // reaped already along with the other children
+        int status;
+        struct rusage usage;
+        processes* job = find_process(w->pid);
+        if (job != NULL && wait4(w->pid, &status, WNOHANG, &usage) == w->pid) finish_job(job, status, &usage);
     }
-    current->next = (processes*) malloc(sizeof(processes));
-    (current->next)->previous = current;
-    current = current->next;
-    current-> id = pid;
-    strcpy(current->prc_name, process_name);
-    current->process_state = RUNNING;
-    current->next = NULL;
-    _inc_jobs(1);
 }
 
-void delete_process(pid_t process_id) {
-    if (head_jobs == NULL) {
-        return; //case when head is empty
+// the status of a job that has already finished, 127 if it is not among the recent ones
+int finished_status(pid_t pid) {
+    long i;
+    for (i = num_finished - 1; i >= 0 && i >= num_finished - FINISHED_JOBS; i--) {
+        if (finished_jobs[i % FINISHED_JOBS].id == pid) return finished_jobs[i % FINISHED_JOBS].exit_status;
     }
-    processes* current = head_jobs;
-    while (current->next != NULL && (current->next)->id != process_id) {
-        current = current->next;
+    return 127;
+}
+
+// reads the steps of a run-dag file, NULL after a message if it cannot
+dag_step* read_dag(char* filename, int* num_steps) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("run-dag: %s: %s.\n", filename, strerror(errno));
+        return NULL;
     }
-    
-    if (current->next == NULL) {
-        return;
+    line_reader reader;
+    init_reader(&reader, fd);
+    int count = 0, size = 16, number = 0;
+    dag_step* steps = (dag_step*) malloc(size * sizeof(dag_step));
+    char* line;
+    bool ok = true;
+    while (ok && (line = read_line(&reader)) != NULL) {
+        number++;
+        char* colon = strchr(line, ':');
+        if (colon == NULL) {
+            if (strspn(line, " \t\r") != strlen(line)) {
+                printf("run-dag: %s:%d: expected name [needs ...]: command.\n", filename, number);
+                ok = false;
+            }
+            continue;
+        }
+        *colon = '\0';
+        char** names = tokenify(line, " \t");
+        if (names[0] == NULL) {
+            printf("run-dag: %s:%d: the step has no name.\n", filename, number);
+            free_tokens(names);
+            ok = false;
+            continue;
+        }
+        if (count == size) {
+            size *= 2;
+            steps = (dag_step*) realloc(steps, size * sizeof(dag_step));
+        }
+        dag_step* step = &steps[count++];
+        memset(step, 0, sizeof(dag_step));
+        step->name = names[0];
+        step->needs = names; // names[0] is the step itself, skipped when linking
+        step->command = strdup(colon + 1);
     }
-    
-    processes* tmp = current->next;
-    if (tmp->next == NULL) {
-        current->next = NULL;   
-    } else {
-        current->next = tmp->next;
-        (current->next)->previous = tmp->previous;
+    free_reader(&reader);
+    close(fd);
+    *num_steps = count;
+    if (!ok) {
+        free_dag(steps, count);
+        return NULL;
     }
-    tmp->previous = current;
-    _inc_jobs(-1);
-    free(tmp);
-    return;
+    return steps;
 }
 
-void delete_process_by_name(char* process_name) {
-    if (head_jobs == NULL) {
-        return; //case when head is empty
+/* resolves each step's needs by binary search over the names and checks the
+ * graph has no cycle by taking steps off in dependency order, as run_dag will */
+bool link_dag(dag_step* steps, int num_steps) {
+    dag_step** by_name = (dag_step**) malloc((num_steps + 1) * sizeof(dag_step*));
+    int i, j;
+    for (i = 0; i < num_steps; i++) by_name[i] = &steps[i];
+    qsort(by_name, num_steps, sizeof(dag_step*), compare_steps);
+    bool ok = true;
+    for (i = 1; i < num_steps; i++) {
+        if (strcmp(by_name[i - 1]->name, by_name[i]->name) != 0) continue;
+        printf("run-dag: step %s is defined twice.\n", by_name[i]->name);
+        ok = false;
     }
-    processes* current = head_jobs;
-    // iterate through to desired job
-    while (current->next != NULL && strcmp((current->next)->prc_name, process_name) != 0) {
-        current = current->next;
+    for (i = 0; ok && i < num_steps; i++) {
+        for (j = 1; steps[i].needs[j] != NULL; j++) {
+            dag_step key = {.name = steps[i].needs[j]};
+            dag_step* key_ptr = &key;
+            dag_step** found = bsearch(&key_ptr, by_name, num_steps, sizeof(dag_step*), compare_steps);
+            if (found == NULL) {
+                printf("run-dag: step %s needs %s, which is not defined.\n", steps[i].name, steps[i].needs[j]);
+                ok = false;
+                break;
+            }
+            dag_step* need = *found;
+            if (need->num_dependents % 8 == 0) need->dependents = realloc(need->dependents, (need->num_dependents + 8) * sizeof(int));
+            need->dependents[need->num_dependents++] = i;
+            steps[i].waiting++;
+        }
     }
+    free(by_name);
+    if (!ok) return false;
     
-    if (current->next == NULL) {
-        return;
+    int* order = (int*) malloc(num_steps * sizeof(int));
+    int* waiting = (int*) malloc(num_steps * sizeof(int));
+    int head = 0, tail = 0;
+    for (i = 0; i < num_steps; i++) {
+        waiting[i] = steps[i].waiting;
+        if (waiting[i] == 0) order[tail++] = i;
     }
-    
-    processes* tmp = current->next;
-    if (tmp->next == NULL) {
-        current->next = NULL;   
-    } else {
-        current->next = tmp->next;
-        (current->next)->previous = tmp->previous;
+    while (head < tail) {
+        dag_step* step = &steps[order[head++]];
+        for (j = 0; j < step->num_dependents; j++) {
+            if (--waiting[step->dependents[j]] == 0) order[tail++] = step->dependents[j];
+        }
     }
-    tmp->previous = current;
-    _inc_jobs(-1);
-    free(tmp);
-    return;
+    if (tail < num_steps) printf("run-dag: the steps depend on each other in a cycle.\n");
+    free(order);
+    free(waiting);
+    return tail == num_steps;
 }
 
-void print_processes(processes* head) {
-    processes* current = head_jobs->next;
+int compare_steps(const void* a, const void* b) {
+    return strcmp((*(dag_step* const*) a)->name, (*(dag_step* const*) b)->name);
+}
 
-    while(current != NULL) {
-        char p_state [32] = "";
-        if (current->process_state == PAUSED) {
-            strcpy(p_state, "PAUSED");
-        } else if (current->process_state == DEAD) {
-            strcpy(p_state, "DEAD"); // plan to keep a list of active and inactive processes
-        } else {
-            strcpy(p_state, "RUNNING");
+/* starts every ready step while fewer than max_jobs are running and sleeps in
+ * the event loop until one of them ends. Steps are jobs like any other, so
+ * jobs lists them and finish_job records their status in the step */
+int run_dag(dag_step* steps, int num_steps, int max_jobs, path* head, program_state** p_state) {
+    int* ready = (int*) malloc(num_steps * sizeof(int));
+    int* running = (int*) malloc(num_steps * sizeof(int));
+    int ready_head = 0, ready_tail = 0, num_running = 0, failed = 0, skipped = 0, i;
+    for (i = 0; i < num_steps; i++) {
+        if (steps[i].waiting == 0) ready[ready_tail++] = i;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while (num_running > 0 || ready_head < ready_tail) {
+        while (num_running < max_jobs && ready_head < ready_tail) {
+            int next = ready[ready_head++];
+            if (start_step(&steps[next], head, p_state)) {
+                running[num_running++] = next;
+                continue;
+            }
+            steps[next].state = STEP_FAILED;
+            failed++;
+            skipped += skip_dependents(steps, next);
+        }
+        if (num_running == 0) continue;
+        if (wait_for_events(-1) & EVENT_CHILD) {
+            reap_children();
+            schedule_jobs(head, p_state);
         }
         
-        printf("[%d]: %s - STATUS: %s\n", current->id, current->prc_name, p_state);
-        current = current->next;
+        for (i = 0; i < num_running; i++) {
+            dag_step* step = &steps[running[i]];
+            if (!step->job.done) continue;
+            int finished = running[i];
+            running[i--] = running[--num_running];
+            if (step->job.status != 0) {
+                printf("Step %s failed with status %d.\n", step->name, step->job.status);
+                step->state = STEP_FAILED;
+                failed++;
+                skipped += skip_dependents(steps, finished);
+                continue;
+            }
+            step->state = STEP_DONE;
+            int j;
+            for (j = 0; j < step->num_dependents; j++) {
+                dag_step* dependent = &steps[step->dependents[j]];
+                if (--dependent->waiting == 0 && dependent->state == STEP_WAITING) ready[ready_tail++] = step->dependents[j];
+            }
+        }
     }
-    return;
+    printf("%d steps: %d succeeded, %d failed, %d skipped, %.3f s.\n",
+           num_steps, num_steps - failed - skipped, failed, skipped, seconds_since(&start));
+    free(ready);
+    free(running);
+    return failed > 0 ? 1 : 0;
+}
+
+/* runs the step's command line in a forked copy of the shell, so a step can
+ * be anything a line can: pipelines, redirections, ; && and || */
+bool start_step(dag_step* step, path* head, program_state** p_state) {
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    bool captured = output_mode != OUTPUT_DIRECT && start_capture(fds);
+    fflush(stdout); // or the child would print our buffered output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        redirect_stdio(fds);
+        forget_jobs();
+        run_journal.fd = -1; // the step is journaled, if at all, by the shell that started it
+        reply_fd = -1;
+        interactive = false;
+        (*p_state)->mode = SEQUENTIAL;
+        run_line(step->command, head, p_state);
+        fflush(stdout);
+        _exit((*p_state)->last_status);
+    }
+    if (captured) end_capture_setup(fds);
+    if (pid < 0) {
+        printf("Step %s could not be started: %s.\n", step->name, strerror(errno));
+        return false;
+    }
+    processes* job = add_process(pid, step->command);
+    job->reports_status = true;
+    job->waiter = &step->job;
+    job->journal_id = 0; // steps are not journaled on their own, the run-dag line is once it is done
+    job->reply_fd = -1; // nor do they reply, run-dag does
+    step->job.pid = pid;
+    step->state = STEP_RUNNING;
+    return true;
+}
+
+// marks everything downstream of a failed step as skipped, returns how many
+int skip_dependents(dag_step* steps, int failed) {
+    int skipped = 0, i;
+    dag_step* step = &steps[failed];
+    for (i = 0; i < step->num_dependents; i++) {
+        dag_step* dependent = &steps[step->dependents[i]];
+        if (dependent->state != STEP_WAITING) continue;
+        dependent->state = STEP_SKIPPED;
+        printf("Step %s skipped, it needs %s.\n", dependent->name, step->name);
+        skipped += 1 + skip_dependents(steps, step->dependents[i]);
+    }
+    return skipped;
+}
+
+// the shell's jobs belong to the parent, a forked copy starts with none
+void forget_jobs() {
+    _inc_jobs(-_inc_jobs(0));
+    head_jobs->next = NULL;
+    tail_jobs = head_jobs;
+    memset(job_index, 0, sizeof(job_index));
+    head_queue = tail_queue = NULL;
+    queue_depth = 0;
+}
+
+void free_dag(dag_step* steps, int num_steps) {
+    int i;
+    for (i = 0; i < num_steps; i++) {
+        free_tokens(steps[i].needs);
+        free(steps[i].command);
+        free(steps[i].dependents);
+    }
+    free(steps);
+}
+
+void print_queue() {
+    queued_job* current;
+    int position = 1;
+    for (current = head_queue; current != NULL; current = current->next)
+        printf("[queued %d]: %s - STATUS: QUEUED\n", position++, current->command->text);
 }
 
 // function with static variable that keeps track of the number of jobs
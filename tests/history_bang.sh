@@ -0,0 +1,31 @@
+#!/bin/sh
+# Checks that a ! followed by a quote, an operator or nothing is left alone by
+# history expansion, while !prefix still recalls a command. History is only
+# expanded at a terminal, so the shell is run under script(1).
+#
+# Usage: history_bang.sh [shell]
+
+SHELL_BIN=$(realpath "${1:-./proj02}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+if ! command -v script > /dev/null; then
+    echo "script(1) is not installed, history expansion not checked"
+    exit 0
+fi
+
+printf '%s\n' 'echo one' 'echo "wow!"' 'echo a!;echo b! | cat' 'echo (x!)' '/bin/echo !ech' exit |
+    HOME=$DIR timeout 10 script -qec "$SHELL_BIN" /dev/null | tr -d '\r' > "$DIR/out"
+
+failed=0
+for line in 'wow!' 'a!' 'b!' '(x!)' 'echo (x!)'; do
+    if ! grep -qxF "$line" "$DIR/out"; then
+        echo "expected a line '$line'"
+        failed=1
+    fi
+done
+if grep -q 'wowecho' "$DIR/out"; then
+    echo "!\" recalled a command"
+    failed=1
+fi
+[ $failed -eq 0 ] && echo "history left lone ! alone"
+exit $failed
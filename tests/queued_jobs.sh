@@ -0,0 +1,42 @@
+#!/bin/sh
+# Checks that a command waiting in the parallel queue runs with the variables,
+# file names and working directory of the moment its line reached it, even
+# when the line changes them before a job slot frees up.
+#
+# Usage: queued_jobs.sh [shell]
+
+SHELL_BIN=${1:-./proj02}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/a" "$DIR/b"
+touch "$DIR/a/one"
+
+# mode takes effect after its own line, the rest is one line so that it
+# changes things while the queued command waits
+failed=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "$1: expected '$3', got '$2'"
+        failed=1
+    fi
+}
+
+out=$("$SHELL_BIN" -c 'mode parallel 1
+sleep 0.2; X=first; /bin/echo $X; X=second')
+check "variable" "$out" "first"
+out=$("$SHELL_BIN" -c 'export Y=first
+mode parallel 1
+sleep 0.2; /bin/sh -c "echo \$Y \$Z"; export Y=second; export Z=new')
+check "exported variable" "$out" "first"
+out=$("$SHELL_BIN" -c "mode parallel 1
+sleep 0.2; cd $DIR/a; /bin/pwd; cd $DIR/b")
+check "directory" "$out" "$DIR/a"
+out=$("$SHELL_BIN" -c "mode parallel 1
+cd $DIR/a; sleep 0.2; /bin/echo o*; cd $DIR/b; touch other")
+check "glob" "$out" "one"
+out=$("$SHELL_BIN" -c "mode parallel 1
+cd $DIR/a; sleep 0.2; /bin/echo queued > out; cd $DIR/b")
+check "redirection" "$(cat "$DIR/a/out" 2>/dev/null)" "queued"
+
+[ $failed -eq 0 ] && echo "queued jobs ran as they were queued"
+exit $failed
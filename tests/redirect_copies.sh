@@ -0,0 +1,38 @@
+#!/bin/sh
+# Checks N>&M: 2>&1 after a file sends errors to the file, before it to the
+# old standard output, and a malformed copy is a syntax error rather than a
+# file named &1.
+#
+# Usage: redirect_copies.sh [shell]
+
+SHELL_BIN=$(realpath "${1:-./proj02}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+failed=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "$1: expected '$3', got '$2'"
+        failed=1
+    fi
+}
+
+for backend in spawn fork; do
+    "$SHELL_BIN" -s $backend -c 'ls /nonexistent > after 2>&1' > /dev/null 2>&1
+    check "$backend: > file 2>&1" "$(grep -c nonexistent after)" "1"
+    out=$("$SHELL_BIN" -s $backend -c 'ls /nonexistent 2>&1 > before' 2> /dev/null)
+    check "$backend: 2>&1 > file" "$(echo "$out" | grep -c nonexistent)/$(wc -c < before)" "1/0"
+    out=$("$SHELL_BIN" -s $backend -c 'ls /nonexistent 2>&1 | wc -l' 2> /dev/null)
+    check "$backend: 2>&1 |" "$out" "1"
+    out=$("$SHELL_BIN" -s $backend -c 'echo moved 1>&2' 2>&1 > /dev/null)
+    check "$backend: builtin 1>&2" "$out" "moved"
+done
+out=$("$SHELL_BIN" -c 'echo x 2>&3
+echo y 2> &1')
+check "bad copies" "$out" "Syntax error: descriptor to copy must be 0, 1 or 2.
+Syntax error: missing file name after redirection."
+[ -e "$DIR/&1" ] && { echo "a file named &1 was created"; failed=1; }
+
+[ $failed -eq 0 ] && echo "descriptor copies went where they should"
+exit $failed
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Checks that the tee builtin writes every byte to each of several files, with
+# the default pipe size and with big pipes, where a chunk can be larger than
+# one tee into the scratch pipe takes.
+#
+# Usage: tee_files.sh [shell] [size in MB]
+
+SHELL_BIN=${1:-./proj02}
+SIZE_MB=${2:-20}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/input"
+failed=0
+for size in 0 1048576; do
+    rm -f "$DIR"/t*
+    "$SHELL_BIN" -c "pipesize $size; cat $DIR/input | tee $DIR/ta $DIR/tb $DIR/tc | cat > $DIR/tout" > /dev/null
+    for file in ta tb tc tout; do
+        if ! cmp -s "$DIR/input" "$DIR/$file"; then
+            echo "pipesize $size: $file differs from the input"
+            failed=1
+        fi
+    done
+done
+[ $failed -eq 0 ] && echo "tee wrote $SIZE_MB MB to every file"
+exit $failed